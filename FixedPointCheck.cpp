@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2021, Thomas DiModica
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+   FixedPointCheck renders music with both the fixed point and the floating point versions of the engine
+   (Maestro::render<short> and Maestro::render<double>), and fails if they are further apart than they should be.
+   The two don't agree to the sample: the fixed point version flips a square wave a sample early or late now and then,
+   and rounds differently. So what is checked is the mean difference, and how many samples are far off.
+   Noise can't be compared a sample at a time (the fixed point version quantizes its time to samples), so voices that
+   use the noise instrument are taken out of the song and checked on their own: they have to be about as loud.
+   Build it with TD_SOUND_FIXED_POINT defined (see FixedPointCheck.sh), and run it on files or directories of music.
+   With no arguments, it checks SampleMusic. It exits with 0 if everything passed, and 1 if anything didn't.
+ */
+
+#define TD_SOUND_IMPLEMENTATION
+#include "SoundEngine.h"
+
+#ifndef TD_SOUND_FIXED_POINT
+#error "Build FixedPointCheck with TD_SOUND_FIXED_POINT defined."
+#endif
+
+#include <fstream>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <cmath>
+
+static const int samplerate = 44100;
+static const size_t blockSize = 4096U;
+// The most the mean difference can be, in 16-bit steps. The fixed point version rounds down when it shifts, which makes
+// each note that is playing about a step lower, so chords differ by a few steps (that is about -78 dB, and inaudible).
+// A mistake in a pitch, a tempo, an envelope, or a volume makes a difference of hundreds or thousands of steps.
+static const double meanTolerance = 4.0;
+static const int farOff = 64; // A sample is far off when it differs by more than this many 16-bit steps...
+static const double farOffTolerance = 0.02; // ...and no more than this fraction of the samples can be.
+static const double noiseTolerance = 0.05; // A noise voice's RMS can differ by this fraction of the floating point one.
+
+// Read the voices out of a music file, the way MakeWave does, but leave out the empty ones, as the Maestro would.
+static bool readMusic (const std::string& name, std::vector<std::string>& voices)
+ {
+   std::ifstream music (name);
+   if (false == music.good())
+    {
+      return false;
+    }
+   std::string line;
+   while (std::getline(music, line))
+    {
+      if ((false == line.empty()) && ('/' != line[0]) && (false == std::all_of(line.begin(), line.end(), [](char c) { return 0 != std::isspace(static_cast<unsigned char>(c)); })))
+       {
+         voices.push_back(line);
+       }
+    }
+   return true;
+ }
+
+// Does the voice use the noise instrument (IN, in any case and with any spaces)? I is only ever the instrument command.
+static bool isNoise (const std::string& voice)
+ {
+   std::string music;
+   for (char c : voice)
+    {
+      if (0 == std::isspace(static_cast<unsigned char>(c)))
+       {
+         music.push_back(static_cast<char>(std::toupper(static_cast<unsigned char>(c))));
+       }
+    }
+   return std::string::npos != music.find("IN");
+ }
+
+// Render the whole song both ways, the floating point version as 16-bit PCM, as MakeWave would write it.
+static void renderBoth (const std::vector<std::string>& voices, std::vector<short>& fixed, std::vector<short>& floating)
+ {
+   const double step = 1.0 / samplerate;
+   TD_SOUND::Maestro fixedSong (voices);
+   TD_SOUND::Maestro floatSong (voices);
+   size_t played = blockSize;
+   while (blockSize == played)
+    {
+      short block [blockSize];
+      played = fixedSong.render<short>(block, blockSize, fixed.size(), step);
+      fixed.insert(fixed.end(), block, block + played);
+    }
+   played = blockSize;
+   while (blockSize == played)
+    {
+      double block [blockSize];
+      short converted [blockSize];
+      played = floatSong.render<double>(block, blockSize, floating.size(), step);
+      TD_SOUND::getKernels().doubleToPCM16(block, converted, played);
+      floating.insert(floating.end(), converted, converted + played);
+    }
+ }
+
+static double rms (const std::vector<short>& samples)
+ {
+   double sum = 0.0;
+   for (short sample : samples)
+    {
+      sum += static_cast<double>(sample) * sample;
+    }
+   return (true == samples.empty()) ? 0.0 : std::sqrt(sum / samples.size());
+ }
+
+// Check one file, saying how it went. Returns false if it failed.
+static bool check (const std::string& name)
+ {
+   std::vector<std::string> voices;
+   if ((false == readMusic(name, voices)) || (true == voices.empty()))
+    {
+      std::cout << name << ": FAILED, couldn't read it" << std::endl;
+      return false;
+    }
+   std::vector<std::string> tonal, noise;
+   for (const std::string& voice : voices)
+    {
+      ((true == isNoise(voice)) ? noise : tonal).push_back(voice);
+    }
+
+   bool passed = true;
+   try
+    {
+      if (false == tonal.empty())
+       {
+         std::vector<short> fixed, floating;
+         renderBoth(tonal, fixed, floating);
+         size_t common = std::min(fixed.size(), floating.size());
+         double total = 0.0;
+         size_t far = 0U;
+         for (size_t i = 0U; i < common; ++i)
+          {
+            int difference = std::abs(static_cast<int>(fixed[i]) - floating[i]);
+            total += difference;
+            far += (difference > farOff) ? 1U : 0U;
+          }
+         double mean = (0U == common) ? 0.0 : total / common;
+         double farFraction = (0U == common) ? 0.0 : static_cast<double>(far) / common;
+         bool good = (fixed.size() == floating.size()) && (mean <= meanTolerance) && (farFraction <= farOffTolerance);
+         std::cout << name << ": " << fixed.size() << " (fixed) and " << floating.size() << " (floating) samples, mean difference " <<
+            mean << ", far off " << (100.0 * farFraction) << "%" << ((true == good) ? "" : ": FAILED") << std::endl;
+         passed &= good;
+       }
+      for (size_t i = 0U; i < noise.size(); ++i)
+       {
+         std::vector<short> fixed, floating;
+         renderBoth(std::vector<std::string>(1U, noise[i]), fixed, floating);
+         double fixedLevel = rms(fixed);
+         double floatLevel = rms(floating);
+         bool good = (fixed.size() == floating.size()) && (std::fabs(fixedLevel - floatLevel) <= noiseTolerance * floatLevel);
+         std::cout << name << ": noise voice " << (i + 1U) << ", RMS " << fixedLevel << " (fixed) and " << floatLevel << " (floating)" <<
+            ((true == good) ? "" : ": FAILED") << std::endl;
+         passed &= good;
+       }
+    }
+   catch (const std::invalid_argument& e)
+    {
+      std::cout << name << ": FAILED, " << e.what() << std::endl;
+      passed = false;
+    }
+   return passed;
+ }
+
+int main (int argc, char ** argv)
+ {
+   std::vector<std::string> names;
+   std::vector<std::string> given (argv + 1, argv + argc);
+   if (true == given.empty())
+    {
+      given.push_back("SampleMusic");
+    }
+   for (const std::string& name : given)
+    {
+      std::error_code error;
+      if (true == std::filesystem::is_directory(name, error))
+       {
+         std::vector<std::string> found;
+         for (const auto& entry : std::filesystem::directory_iterator(name, error))
+          {
+            if (".txt" == entry.path().extension())
+             {
+               found.push_back(entry.path().string());
+             }
+          }
+         std::sort(found.begin(), found.end());
+         names.insert(names.end(), found.begin(), found.end());
+       }
+      else
+       {
+         names.push_back(name);
+       }
+    }
+
+   size_t failed = 0U;
+   for (const std::string& name : names)
+    {
+      failed += (true == check(name)) ? 0U : 1U;
+    }
+   std::cout << (names.size() - failed) << " of " << names.size() << " passed" << std::endl;
+   return (0U == failed) ? 0 : 1;
+ }
@@ -0,0 +1,4 @@
+#!/bin/bash
+
+# Checks the fixed point version of the engine against the floating point version: run ./FixedPointCheck, which exits with 1 on a failure.
+x86_64-w64-mingw32-g++.exe -s -O2 -std=c++17 -o FixedPointCheck -DTD_SOUND_FIXED_POINT -Weffc++ -Wall -Wextra -Wpedantic FixedPointCheck.cpp
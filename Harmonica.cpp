@@ -193,6 +193,7 @@ private:
    static double samples[512];
    static int sample;
    std::vector<std::string> soundString;
+   TD_SOUND::Maestro song;
    double globalTime;
    bool started;
 
@@ -208,23 +209,26 @@ private:
     }
 
 public:
-   SoundPlayer(const std::vector<std::string>& soundString) : soundString(soundString), globalTime(0.0), started(false)
+   SoundPlayer(const std::vector<std::string>& soundString) : soundString(soundString), song(), globalTime(0.0), started(false)
     {
       sAppName = "Sound Player";
     }
 
    bool OnUserCreate() override
     {
+      // Requeue the music from the Venue's thread, rather than the audio thread.
+      TD_SOUND::Venue::getInstance().addMusicCallback(std::bind(&SoundPlayer::OnMusicEnded, this));
+      TD_SOUND::Venue::getInstance().setCallbackMode(TD_SOUND::Venue::CallbackMode::Worker);
       olc::SOUND::InitialiseAudio(44100, 1, 8, 512);
       olc::SOUND::SetUserSynthFunction(MyCustomSynthFunction);
-      TD_SOUND::Venue::getInstance().addMusicCallback(std::bind(&SoundPlayer::OnMusicEnded, this));
       return true;
     }
 
    void OnMusicEnded (void)
     {
       // This should only be called if this was previously parsed successfully.
-      TD_SOUND::Venue::getInstance().queueMusic(soundString, buildInstrument());
+      // Queueing the same song again doesn't parse or copy anything: the copy shares its notes with song.
+      TD_SOUND::Venue::getInstance().queueMusic(song);
     }
 
    bool OnUserUpdate(float fElapsedTime) override
@@ -245,7 +249,8 @@ public:
          started = true;
          try
           {
-            TD_SOUND::Venue::getInstance().queueMusic(soundString, buildInstrument());
+            song = TD_SOUND::Maestro(soundString, buildInstrument());
+            TD_SOUND::Venue::getInstance().queueMusic(song);
           }
          catch (const std::invalid_argument& e)
           {
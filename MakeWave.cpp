@@ -34,24 +34,1528 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <fstream>
 #include <string>
 #include <iostream>
+#include <thread>
+#include <cstdlib>
+#include <algorithm>
+#include <filesystem>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cctype>
+#include <iomanip>
+#include <set>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
-int main (int argc, char ** argv)
+static const size_t blockSize = 4096U;
+static const size_t pieceSize = 65536U; // How much each thread renders at a time: this is what bounds the memory used.
+
+#ifdef TD_SOUND_FIXED_POINT
+typedef short Mix;
+typedef int Stem; // The fixed point stems are wider than a short: they are only clamped once they are mixed.
+#else
+typedef double Mix;
+typedef double Stem;
+#endif
+
+static const char engineVersion[] = "SoundEngine 2.1"; // Change this with the engine, so that the cache doesn't hand back old music.
+
+// What goes in the WAV file. The music is mono: every channel gets the same thing.
+struct Format
+ {
+   int samplerate;
+   unsigned int bits; // 16 or 24 for integer samples, or 32 for float.
+   unsigned int channels;
+ };
+
+static unsigned int frameBytes (const Format& format)
+ {
+   return format.channels * format.bits / 8U;
+ }
+
+// Where the music goes, as it is rendered.
+class MusicWriter
+ {
+public:
+   virtual ~MusicWriter() = default;
+   virtual bool good() const = 0;
+   virtual void write(const char* music, size_t count) = 0; // count samples, for every channel.
+   virtual bool finish() = 0; // Returns false if anything couldn't be written.
+ };
+
+/*
+   WaveWriter writes a WAV file as it is rendered, so the song never has to be in memory all at once.
+   The sizes in the header are filled in when it is finished. If the song could be more than 4 GB, it is written as RF64.
+   The file "-" is standard output. That can't be gone back over, so the sizes are left as 0xFFFFFFFF, which means: read to the end.
+   More than two channels, or more than 16 bits, needs the WAVE_FORMAT_EXTENSIBLE header, and float needs a fact chunk too.
+ */
+class WaveWriter : public MusicWriter
+ {
+private:
+   std::ofstream file;
+   std::ostream& out;
+   bool seekable;
+   bool large;
+   bool isFloat;
+   unsigned int frameSize;
+   uint64_t frames;
+   uint32_t headerSize; // Everything before the data.
+
+   void write16(uint16_t value);
+   void write32(uint32_t value);
+   void write64(uint64_t value);
+
+public:
+   // expected is the most samples that there could be.
+   WaveWriter(const std::string& name, const Format& format, uint64_t expected);
+   WaveWriter(const WaveWriter&) = delete;
+   WaveWriter& operator=(const WaveWriter&) = delete;
+
+   bool good() const override;
+   void write(const char* music, size_t count) override;
+   bool finish() override;
+ };
+
+WaveWriter::WaveWriter(const std::string& name, const Format& format, uint64_t expected) :
+   file(), out(("-" == name) ? std::cout : file), seekable("-" != name), large(false), isFloat(32U == format.bits),
+   frameSize(frameBytes(format)), frames(0U), headerSize(0U)
+ {
+   if (true == seekable)
+    {
+      file.open(name, std::ios::out | std::ios::binary);
+    }
+   else
+    {
+#ifdef _WIN32
+      _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+   bool extensible = (format.channels > 2U) || (format.bits > 16U);
+   headerSize = 12U + 24U + ((true == extensible) ? 24U : 0U) + ((true == isFloat) ? 12U : 0U) + 8U;
+   large = seekable && (headerSize - 8U + frameSize * expected > 0xFFFFFFFFU);
+   if (true == large)
+    {
+      headerSize += 36U;
+    }
+   out.write((true == large) ? "RF64" : "RIFF", 4);
+   write32(0xFFFFFFFFU); // The size of the file, after this.
+   out.write("WAVE", 4);
+   if (true == large)
+    {
+      out.write("ds64", 4);
+      write32(28U); // Size of chunk
+      write64(0U); // The size of the file, after the first eight bytes.
+      write64(0U); // The size of the data.
+      write64(0U); // The number of samples.
+      write32(0U); // No table.
+    }
+   out.write("fmt ", 4);
+   write32((true == extensible) ? 40U : 16U); // Size of header
+   write16((true == extensible) ? 0xFFFEU : 1U); // Format : 1 = PCM, 0xFFFE = extensible (which says PCM or float below)
+   write16(static_cast<uint16_t>(format.channels));
+   write32(static_cast<uint32_t>(format.samplerate));
+   write32(static_cast<uint32_t>(format.samplerate) * frameSize); // Bytes per second
+   write16(static_cast<uint16_t>(frameSize)); // Block align : channels * bytes per sample
+   write16(static_cast<uint16_t>(format.bits));
+   if (true == extensible)
+    {
+      // The usual speakers for that many channels: mono is center, stereo is left and right, up to 7.1.
+      static const uint32_t speakers [8] = { 0x4U, 0x3U, 0x7U, 0x33U, 0x37U, 0x3FU, 0x13FU, 0x63FU };
+      write16(22U); // Size of the extension
+      write16(static_cast<uint16_t>(format.bits)); // Valid bits in each sample
+      write32(speakers[format.channels - 1U]);
+      write32((true == isFloat) ? 3U : 1U); // The format GUID : 1 = PCM, 3 = float, and then the rest of the GUID
+      out.write("\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71", 12);
+    }
+   if (true == isFloat)
+    {
+      out.write("fact", 4);
+      write32(4U);
+      write32(0xFFFFFFFFU); // The number of samples.
+    }
+   out.write("data", 4);
+   write32(0xFFFFFFFFU); // The size of the data.
+ }
+
+void WaveWriter::write16(uint16_t value)
+ {
+   char bytes [2] = { static_cast<char>(value), static_cast<char>(value >> 8) };
+   out.write(bytes, 2);
+ }
+
+void WaveWriter::write32(uint32_t value)
+ {
+   write16(static_cast<uint16_t>(value));
+   write16(static_cast<uint16_t>(value >> 16));
+ }
+
+void WaveWriter::write64(uint64_t value)
+ {
+   write32(static_cast<uint32_t>(value));
+   write32(static_cast<uint32_t>(value >> 32));
+ }
+
+bool WaveWriter::good() const
+ {
+   return out.good();
+ }
+
+void WaveWriter::write(const char* music, size_t count)
+ {
+   out.write(music, frameSize * count);
+   frames += count;
+ }
+
+bool WaveWriter::finish()
+ {
+   if (true == seekable)
+    {
+      uint64_t dataSize = frameSize * frames;
+      uint64_t riffSize = headerSize - 8U + dataSize + (dataSize & 1U);
+      if (1U == (dataSize & 1U)) // Chunks are padded to an even size.
+       {
+         out.put('\0');
+       }
+      if (true == large)
+       {
+         out.seekp(20);
+         write64(riffSize);
+         write64(dataSize);
+         write64(frames);
+       }
+      else
+       {
+         out.seekp(4);
+         write32(static_cast<uint32_t>(std::min<uint64_t>(riffSize, 0xFFFFFFFFU)));
+       }
+      if (true == isFloat) // The fact chunk is just before the data.
+       {
+         out.seekp(headerSize - 12U);
+         write32(static_cast<uint32_t>(std::min<uint64_t>(frames, 0xFFFFFFFFU)));
+       }
+      out.seekp(headerSize - 4U);
+      write32((true == large) ? 0xFFFFFFFFU : static_cast<uint32_t>(dataSize));
+    }
+   out.flush();
+   return out.good();
+ }
+
+/*
+   FlacWriter writes a FLAC file: lossless, and a fraction of the size of a WAV file, especially for chiptunes.
+   Each block of 4096 samples is predicted (with a fixed polynomial, or linear prediction fitted to the block, whichever
+   is smaller), and what the prediction missed is Rice coded. Identical channels are only encoded once, and stereo is
+   encoded as left and side, which is silence for mono music.
+   The encoding is done on a thread of its own: write only waits if the encoder has fallen a few pieces behind.
+   As with a WAV file, the header is filled in when it is finished, unless the file is standard output.
+ */
+class FlacWriter : public MusicWriter
+ {
+private:
+   std::ofstream file;
+   std::ostream& out;
+   bool seekable;
+   Format format;
+   std::vector<std::vector<int32_t> > channels; // The samples waiting to be encoded.
+   size_t buffered;
+   uint64_t samples;
+   uint64_t frameNumber;
+   uint32_t minFrame;
+   uint32_t maxFrame;
+   std::mutex lock;
+   std::condition_variable changed;
+   std::list<std::vector<char> > pending;
+   bool finishing;
+   std::thread encoder;
+
+   void encode();
+   void take(const std::vector<char>& music);
+   void encodeFrame();
+   void writeStreamInfo();
+
+public:
+   FlacWriter(const std::string& name, const Format& format);
+   ~FlacWriter();
+   FlacWriter(const FlacWriter&) = delete;
+   FlacWriter& operator=(const FlacWriter&) = delete;
+
+   bool good() const override;
+   void write(const char* music, size_t count) override;
+   bool finish() override;
+ };
+
+static const size_t flacBlockSize = 4096U;
+static const unsigned int flacMaxLPCOrder = 8U;
+static const unsigned int flacLPCPrecision = 15U; // Bits in each quantized coefficient.
+static const unsigned int flacMaxPartitionOrder = 8U;
+
+// Bits, most significant first, as FLAC wants them.
+class BitWriter
+ {
+private:
+   std::vector<uint8_t> bytes;
+   uint64_t pending;
+   unsigned int pendingBits;
+
+public:
+   BitWriter() : bytes(), pending(0U), pendingBits(0U) { }
+
+   void put(uint32_t value, unsigned int count)
+    {
+      if (0U == count)
+       {
+         return;
+       }
+      pending = (pending << count) | (value & (0xFFFFFFFFU >> (32U - count)));
+      pendingBits += count;
+      while (pendingBits >= 8U)
+       {
+         pendingBits -= 8U;
+         bytes.push_back(static_cast<uint8_t>(pending >> pendingBits));
+       }
+    }
+
+   void putSigned(int64_t value, unsigned int count)
+    {
+      put(static_cast<uint32_t>(value), count);
+    }
+
+   void putRice(int64_t value, unsigned int parameter)
+    {
+      uint64_t folded = (value < 0) ? ((static_cast<uint64_t>(-(value + 1)) << 1) | 1U) : (static_cast<uint64_t>(value) << 1);
+      uint64_t zeroes = folded >> parameter;
+      while (zeroes >= 32U)
+       {
+         put(0U, 32U);
+         zeroes -= 32U;
+       }
+      put(1U, static_cast<unsigned int>(zeroes) + 1U);
+      put(static_cast<uint32_t>(folded), parameter);
+    }
+
+   void putUTF8(uint64_t value)
+    {
+      if (value < 0x80U)
+       {
+         put(static_cast<uint32_t>(value), 8U);
+         return;
+       }
+      unsigned int extra = 1U;
+      while ((extra < 6U) && (value >= (uint64_t(1U) << (5U * extra + 6U))))
+       {
+         ++extra;
+       }
+      put(((1U << (extra + 1U)) - 1U) << 1, extra + 2U); // As many ones as there are bytes, and a zero.
+      put(static_cast<uint32_t>(value >> (6U * extra)), 6U - extra);
+      for (unsigned int i = extra; i > 0U; --i)
+       {
+         put(0x80U | static_cast<uint32_t>((value >> (6U * (i - 1U))) & 0x3FU), 8U);
+       }
+    }
+
+   void append(const BitWriter& other)
+    {
+      for (uint8_t byte : other.bytes)
+       {
+         put(byte, 8U);
+       }
+      put(static_cast<uint32_t>(other.pending), other.pendingBits);
+    }
+
+   void align()
+    {
+      put(0U, (8U - pendingBits) % 8U);
+    }
+
+   size_t bits() const
+    {
+      return 8U * bytes.size() + pendingBits;
+    }
+
+   const std::vector<uint8_t>& data() const // Only whole bytes.
+    {
+      return bytes;
+    }
+ };
+
+static uint8_t flacCRC8 (const uint8_t* data, size_t count)
+ {
+   uint8_t crc = 0U;
+   for (size_t i = 0U; i < count; ++i)
+    {
+      crc ^= data[i];
+      for (int bit = 0; bit < 8; ++bit)
+       {
+         crc = static_cast<uint8_t>((0U != (crc & 0x80U)) ? ((crc << 1) ^ 0x07U) : (crc << 1));
+       }
+    }
+   return crc;
+ }
+
+static uint16_t flacCRC16 (const uint8_t* data, size_t count)
+ {
+   static const std::array<uint16_t, 256> table = []()
+    {
+      std::array<uint16_t, 256> result;
+      for (unsigned int i = 0U; i < 256U; ++i)
+       {
+         uint16_t crc = static_cast<uint16_t>(i << 8);
+         for (int bit = 0; bit < 8; ++bit)
+          {
+            crc = static_cast<uint16_t>((0U != (crc & 0x8000U)) ? ((crc << 1) ^ 0x8005U) : (crc << 1));
+          }
+         result[i] = crc;
+       }
+      return result;
+    }();
+   uint16_t crc = 0U;
+   for (size_t i = 0U; i < count; ++i)
+    {
+      crc = static_cast<uint16_t>((crc << 8) ^ table[((crc >> 8) ^ data[i]) & 0xFFU]);
+    }
+   return crc;
+ }
+
+// How the residual will be Rice coded: the partition order, and the parameter for each partition.
+struct RicePlan
+ {
+   unsigned int order;
+   std::vector<unsigned int> parameters;
+   size_t bits; // Including the residual's own header.
+ };
+
+// Find the partitioning that codes the residual (which starts after the warm-up samples) in the fewest bits.
+static RicePlan planRice (const std::vector<int64_t>& residual, size_t count, unsigned int predictorOrder)
+ {
+   RicePlan best = { 0U, std::vector<unsigned int>(), std::numeric_limits<size_t>::max() };
+   for (unsigned int order = 0U; order <= flacMaxPartitionOrder; ++order)
+    {
+      size_t partitions = size_t(1U) << order;
+      size_t each = count >> order;
+      if ((0U != (count % partitions)) || (each <= predictorOrder))
+       {
+         break;
+       }
+      RicePlan plan = { order, std::vector<unsigned int>(partitions), 6U };
+      for (size_t partition = 0U; partition < partitions; ++partition)
+       {
+         size_t first = (0U == partition) ? predictorOrder : partition * each;
+         size_t last = (partition + 1U) * each;
+         uint64_t sum = 0U;
+         for (size_t i = first; i < last; ++i)
+          {
+            sum += (residual[i] < 0) ? ((static_cast<uint64_t>(-(residual[i] + 1)) << 1) | 1U) : (static_cast<uint64_t>(residual[i]) << 1);
+          }
+         size_t length = last - first;
+         // The best parameter is close to log2 of the mean: try around it.
+         unsigned int guess = 0U;
+         while ((guess < 30U) && ((uint64_t(length) << (guess + 1U)) < sum))
+          {
+            ++guess;
+          }
+         size_t partitionBits = std::numeric_limits<size_t>::max();
+         for (unsigned int parameter = (guess > 0U) ? guess - 1U : 0U; parameter <= std::min(guess + 1U, 30U); ++parameter)
+          {
+            size_t bits = length * (parameter + 1U) + static_cast<size_t>(sum >> parameter);
+            if (bits < partitionBits)
+             {
+               partitionBits = bits;
+               plan.parameters[partition] = parameter;
+             }
+          }
+         plan.bits += 5U + partitionBits;
+       }
+      if (plan.bits < best.bits)
+       {
+         best = plan;
+       }
+    }
+   return best;
+ }
+
+static void writeResidual (BitWriter& bits, const std::vector<int64_t>& residual, size_t count, unsigned int predictorOrder, const RicePlan& plan)
+ {
+   // Four-bit parameters, unless one needs more.
+   bool wide = (*std::max_element(plan.parameters.begin(), plan.parameters.end()) > 14U);
+   bits.put((true == wide) ? 1U : 0U, 2U);
+   bits.put(plan.order, 4U);
+   size_t each = count >> plan.order;
+   for (size_t partition = 0U; partition < plan.parameters.size(); ++partition)
+    {
+      bits.put(plan.parameters[partition], (true == wide) ? 5U : 4U);
+      size_t first = (0U == partition) ? predictorOrder : partition * each;
+      for (size_t i = first; i < (partition + 1U) * each; ++i)
+       {
+         bits.putRice(residual[i], plan.parameters[partition]);
+       }
+    }
+ }
+
+static void fixedResidual (const int32_t* x, size_t count, unsigned int order, std::vector<int64_t>& residual)
+ {
+   for (size_t i = order; i < count; ++i)
+    {
+      int64_t a = x[i], b = (order > 0U) ? x[i - 1U] : 0, c = (order > 1U) ? x[i - 2U] : 0, d = (order > 2U) ? x[i - 3U] : 0, e = (order > 3U) ? x[i - 4U] : 0;
+      switch (order)
+       {
+         case 0U: residual[i] = a; break;
+         case 1U: residual[i] = a - b; break;
+         case 2U: residual[i] = a - 2 * b + c; break;
+         case 3U: residual[i] = a - 3 * b + 3 * c - d; break;
+         default: residual[i] = a - 4 * b + 6 * c - 4 * d + e; break;
+       }
+    }
+ }
+
+static void lpcResidual (const int32_t* x, size_t count, const std::vector<int32_t>& coefficients, unsigned int shift, std::vector<int64_t>& residual)
+ {
+   size_t order = coefficients.size();
+   for (size_t i = order; i < count; ++i)
+    {
+      int64_t prediction = 0;
+      for (size_t j = 0U; j < order; ++j)
+       {
+         prediction += static_cast<int64_t>(coefficients[j]) * x[i - j - 1U];
+       }
+      residual[i] = x[i] - (prediction >> shift);
+    }
+ }
+
+// Fit linear predictors of each order to the block: autocorrelation of the windowed block, then Levinson-Durbin.
+static std::vector<std::vector<double> > fitLPC (const int32_t* x, size_t count, unsigned int maxOrder)
+ {
+   std::vector<double> windowed (count);
+   for (size_t i = 0U; i < count; ++i) // A Tukey window, tapering the first and last quarter.
+    {
+      double taper = 1.0;
+      double edge = 0.25 * count;
+      double from = std::min(static_cast<double>(i), static_cast<double>(count - 1U - i));
+      if (from < edge)
+       {
+         taper = 0.5 - 0.5 * std::cos(3.141592653589793 * from / edge);
+       }
+      windowed[i] = x[i] * taper;
+    }
+   std::vector<double> correlation (maxOrder + 1U, 0.0);
+   for (unsigned int lag = 0U; lag <= maxOrder; ++lag)
+    {
+      for (size_t i = lag; i < count; ++i)
+       {
+         correlation[lag] += windowed[i] * windowed[i - lag];
+       }
+    }
+   std::vector<std::vector<double> > result;
+   if (correlation[0] <= 0.0)
+    {
+      return result;
+    }
+   std::vector<double> lpc (maxOrder, 0.0), previous (maxOrder, 0.0);
+   double error = correlation[0];
+   for (unsigned int order = 0U; order < maxOrder; ++order)
+    {
+      double reflection = correlation[order + 1U];
+      for (unsigned int j = 0U; j < order; ++j)
+       {
+         reflection -= lpc[j] * correlation[order - j];
+       }
+      reflection /= error;
+      previous = lpc;
+      lpc[order] = reflection;
+      for (unsigned int j = 0U; j < order; ++j)
+       {
+         lpc[j] = previous[j] - reflection * previous[order - 1U - j];
+       }
+      error *= (1.0 - reflection * reflection);
+      result.emplace_back(lpc.begin(), lpc.begin() + order + 1U);
+      if (error <= 0.0)
+       {
+         break;
+       }
+    }
+   return result;
+ }
+
+// Quantize the coefficients to flacLPCPrecision bits, carrying the rounding error along. Returns false if they won't fit.
+static bool quantizeLPC (const std::vector<double>& lpc, std::vector<int32_t>& coefficients, unsigned int& shift)
+ {
+   double largest = 0.0;
+   for (double coefficient : lpc)
+    {
+      largest = std::max(largest, std::fabs(coefficient));
+    }
+   if (0.0 == largest)
+    {
+      return false;
+    }
+   int exponent;
+   std::frexp(largest, &exponent);
+   int scale = static_cast<int>(flacLPCPrecision) - 1 - exponent;
+   if (scale < 0)
+    {
+      return false;
+    }
+   shift = static_cast<unsigned int>(std::min(scale, 15));
+   const int32_t limit = (1 << (flacLPCPrecision - 1U)) - 1;
+   coefficients.resize(lpc.size());
+   double carried = 0.0;
+   for (size_t i = 0U; i < lpc.size(); ++i)
+    {
+      double wanted = lpc[i] * (1 << shift) + carried;
+      int32_t rounded = static_cast<int32_t>(std::clamp(std::lround(wanted), static_cast<long>(-limit - 1), static_cast<long>(limit)));
+      carried = wanted - rounded;
+      coefficients[i] = rounded;
+    }
+   return true;
+ }
+
+static bool fitsResidual (const std::vector<int64_t>& residual, size_t first, size_t count)
+ {
+   for (size_t i = first; i < count; ++i)
+    {
+      if ((residual[i] > std::numeric_limits<int32_t>::max()) || (residual[i] < std::numeric_limits<int32_t>::min() + 1))
+       {
+         return false;
+       }
+    }
+   return true;
+ }
+
+// Encode one channel of a block as a subframe: whichever of constant, fixed, LPC, or verbatim is smallest.
+static void encodeSubframe (BitWriter& bits, const int32_t* x, size_t count, unsigned int bps)
+ {
+   if (std::all_of(x, x + count, [x](int32_t sample) { return sample == x[0]; }))
+    {
+      bits.put(0U, 8U); // Constant
+      bits.putSigned(x[0], bps);
+      return;
+    }
+
+   std::vector<int64_t> residual (count), bestResidual;
+   size_t bestBits = count * bps; // Verbatim
+   unsigned int bestType = 1U;
+   unsigned int bestOrder = 0U;
+   RicePlan bestPlan = { 0U, std::vector<unsigned int>(), 0U };
+   std::vector<int32_t> bestCoefficients;
+   unsigned int bestShift = 0U;
+
+   for (unsigned int order = 0U; (order <= 4U) && (order < count); ++order)
+    {
+      fixedResidual(x, count, order, residual);
+      if (false == fitsResidual(residual, order, count))
+       {
+         continue;
+       }
+      RicePlan plan = planRice(residual, count, order);
+      size_t total = order * bps + plan.bits;
+      if (total < bestBits)
+       {
+         bestBits = total;
+         bestType = 8U | order;
+         bestOrder = order;
+         bestPlan = plan;
+         bestResidual = residual;
+       }
+    }
+
+   std::vector<std::vector<double> > fits = fitLPC(x, count, std::min<unsigned int>(flacMaxLPCOrder, static_cast<unsigned int>(count - 1U)));
+   for (const auto& lpc : fits)
+    {
+      std::vector<int32_t> coefficients;
+      unsigned int shift = 0U;
+      unsigned int order = static_cast<unsigned int>(lpc.size());
+      if (false == quantizeLPC(lpc, coefficients, shift))
+       {
+         continue;
+       }
+      lpcResidual(x, count, coefficients, shift, residual);
+      if (false == fitsResidual(residual, order, count))
+       {
+         continue;
+       }
+      RicePlan plan = planRice(residual, count, order);
+      size_t total = order * bps + 4U + 5U + order * flacLPCPrecision + plan.bits;
+      if (total < bestBits)
+       {
+         bestBits = total;
+         bestType = 32U | (order - 1U);
+         bestOrder = order;
+         bestPlan = plan;
+         bestResidual = residual;
+         bestCoefficients = coefficients;
+         bestShift = shift;
+       }
+    }
+
+   bits.put(bestType << 1, 8U);
+   if (1U == bestType)
+    {
+      for (size_t i = 0U; i < count; ++i)
+       {
+         bits.putSigned(x[i], bps);
+       }
+      return;
+    }
+   for (unsigned int i = 0U; i < bestOrder; ++i)
+    {
+      bits.putSigned(x[i], bps);
+    }
+   if (0U != (bestType & 32U))
+    {
+      bits.put(flacLPCPrecision - 1U, 4U);
+      bits.put(bestShift, 5U);
+      for (int32_t coefficient : bestCoefficients)
+       {
+         bits.putSigned(coefficient, flacLPCPrecision);
+       }
+    }
+   writeResidual(bits, bestResidual, count, bestOrder, bestPlan);
+ }
+
+FlacWriter::FlacWriter(const std::string& name, const Format& format) :
+   file(), out(("-" == name) ? std::cout : file), seekable("-" != name), format(format),
+   channels(format.channels, std::vector<int32_t>(flacBlockSize)), buffered(0U), samples(0U), frameNumber(0U),
+   minFrame(std::numeric_limits<uint32_t>::max()), maxFrame(0U), lock(), changed(), pending(), finishing(false), encoder()
+ {
+   if (true == seekable)
+    {
+      file.open(name, std::ios::out | std::ios::binary);
+    }
+   else
+    {
+#ifdef _WIN32
+      _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+   out.write("fLaC", 4);
+   writeStreamInfo();
+   encoder = std::thread(&FlacWriter::encode, this);
+ }
+
+FlacWriter::~FlacWriter()
+ {
+   if (true == encoder.joinable())
+    {
+      finish();
+    }
+ }
+
+// The only metadata: the format, and (once it's known) how long it is and how big the frames are.
+void FlacWriter::writeStreamInfo()
+ {
+   BitWriter bits;
+   bits.put(0x80U, 8U); // The last metadata block, and it is STREAMINFO.
+   bits.put(34U, 24U);
+   uint32_t block = static_cast<uint32_t>((samples < flacBlockSize) && (0U != samples) ? samples : flacBlockSize);
+   bits.put(block, 16U);
+   bits.put(block, 16U);
+   bits.put((0U == maxFrame) ? 0U : minFrame, 24U); // Zero is unknown.
+   bits.put(maxFrame, 24U);
+   bits.put(static_cast<uint32_t>(format.samplerate), 20U);
+   bits.put(format.channels - 1U, 3U);
+   bits.put(format.bits - 1U, 5U);
+   bits.put(static_cast<uint32_t>(samples >> 32), 4U);
+   bits.put(static_cast<uint32_t>(samples), 32U);
+   for (int i = 0; i < 4; ++i) // No MD5 signature.
+    {
+      bits.put(0U, 32U);
+    }
+   out.write(static_cast<const char*>(static_cast<const void*>(bits.data().data())), bits.data().size());
+ }
+
+bool FlacWriter::good() const
+ {
+   return out.good();
+ }
+
+void FlacWriter::write(const char* music, size_t count)
+ {
+   std::vector<char> piece (music, music + count * frameBytes(format));
+   std::unique_lock<std::mutex> guard (lock);
+   changed.wait(guard, [this]() { return pending.size() < 4U; }); // Don't let the music pile up.
+   pending.emplace_back(std::move(piece));
+   changed.notify_all();
+ }
+
+bool FlacWriter::finish()
+ {
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      finishing = true;
+      changed.notify_all();
+    }
+   if (true == encoder.joinable())
+    {
+      encoder.join();
+    }
+   if (true == seekable)
+    {
+      out.seekp(4);
+      writeStreamInfo();
+    }
+   out.flush();
+   return out.good();
+ }
+
+// The encoder thread.
+void FlacWriter::encode()
+ {
+   for (;;)
+    {
+      std::vector<char> piece;
+       {
+         std::unique_lock<std::mutex> guard (lock);
+         changed.wait(guard, [this]() { return (false == pending.empty()) || (true == finishing); });
+         if (true == pending.empty())
+          {
+            break;
+          }
+         piece = std::move(pending.front());
+         pending.pop_front();
+         changed.notify_all();
+       }
+      take(piece);
+    }
+   if (0U != buffered)
+    {
+      encodeFrame();
+    }
+ }
+
+// Split the channels back out of the PCM, and encode every block that fills up.
+void FlacWriter::take(const std::vector<char>& music)
+ {
+   const unsigned char* in = static_cast<const unsigned char*>(static_cast<const void*>(music.data()));
+   size_t count = music.size() / frameBytes(format);
+   for (size_t i = 0U; i < count; ++i)
+    {
+      for (unsigned int channel = 0U; channel < format.channels; ++channel)
+       {
+         int32_t sample;
+         if (16U == format.bits)
+          {
+            sample = static_cast<int16_t>(in[0] | (in[1] << 8));
+            in += 2;
+          }
+         else
+          {
+            sample = static_cast<int32_t>(static_cast<uint32_t>(in[0]) << 8 | static_cast<uint32_t>(in[1]) << 16 | static_cast<uint32_t>(in[2]) << 24) >> 8;
+            in += 3;
+          }
+         channels[channel][buffered] = sample;
+       }
+      if (flacBlockSize == ++buffered)
+       {
+         encodeFrame();
+       }
+    }
+ }
+
+void FlacWriter::encodeFrame()
+ {
+   size_t count = buffered;
+   unsigned int bps = format.bits;
+   // Encode each channel, unless it is the same as one before it.
+   std::vector<BitWriter> subframes (format.channels);
+   std::vector<unsigned int> same (format.channels);
+   for (unsigned int channel = 0U; channel < format.channels; ++channel)
+    {
+      same[channel] = channel;
+      for (unsigned int earlier = 0U; earlier < channel; ++earlier)
+       {
+         if (true == std::equal(channels[channel].begin(), channels[channel].begin() + count, channels[earlier].begin()))
+          {
+            same[channel] = earlier;
+            break;
+          }
+       }
+      if (channel == same[channel])
+       {
+         encodeSubframe(subframes[channel], channels[channel].data(), count, bps);
+       }
+    }
+   unsigned int assignment = format.channels - 1U;
+   if (2U == format.channels) // Left and side, if the side is smaller than the right.
+    {
+      std::vector<int32_t> side (count);
+      for (size_t i = 0U; i < count; ++i)
+       {
+         side[i] = channels[0][i] - channels[1][i];
+       }
+      BitWriter sideBits;
+      encodeSubframe(sideBits, side.data(), count, bps + 1U);
+      if (sideBits.bits() < subframes[same[1]].bits())
+       {
+         assignment = 8U;
+         subframes[1] = sideBits;
+         same[1] = 1U;
+       }
+    }
+
+   BitWriter frame;
+   frame.put(0xFFF8U, 16U); // Sync, and fixed size blocks.
+   unsigned int blockCode = (flacBlockSize == count) ? 12U : 7U;
+   unsigned int rateCode = 0U; // From STREAMINFO
+   switch (format.samplerate)
+    {
+      case 88200: rateCode = 1U; break;
+      case 176400: rateCode = 2U; break;
+      case 192000: rateCode = 3U; break;
+      case 22050: rateCode = 6U; break;
+      case 24000: rateCode = 7U; break;
+      case 32000: rateCode = 8U; break;
+      case 44100: rateCode = 9U; break;
+      case 48000: rateCode = 10U; break;
+      case 96000: rateCode = 11U; break;
+      default: break;
+    }
+   frame.put(blockCode, 4U);
+   frame.put(rateCode, 4U);
+   frame.put(assignment, 4U);
+   frame.put((16U == bps) ? 4U : 6U, 3U);
+   frame.put(0U, 1U);
+   frame.putUTF8(frameNumber);
+   if (7U == blockCode)
+    {
+      frame.put(static_cast<uint32_t>(count - 1U), 16U);
+    }
+   frame.put(flacCRC8(frame.data().data(), frame.data().size()), 8U);
+   for (unsigned int channel = 0U; channel < format.channels; ++channel)
+    {
+      frame.append(subframes[same[channel]]);
+    }
+   frame.align();
+   uint16_t crc = flacCRC16(frame.data().data(), frame.data().size());
+   frame.put(crc, 16U);
+
+   const std::vector<uint8_t>& bytes = frame.data();
+   out.write(static_cast<const char*>(static_cast<const void*>(bytes.data())), bytes.size());
+   minFrame = std::min(minFrame, static_cast<uint32_t>(bytes.size()));
+   maxFrame = std::max(maxFrame, static_cast<uint32_t>(bytes.size()));
+   samples += count;
+   ++frameNumber;
+   buffered = 0U;
+ }
+
+// Copy each sample to every channel. The samples are already little-endian, like the rest of the file.
+template <typename Value> static void interleave (const Value* in, size_t count, unsigned int channels, char* out)
+ {
+   if (1U == channels)
+    {
+      std::memcpy(out, in, count * sizeof(Value));
+      return;
+    }
+   for (size_t i = 0U; i < count; ++i)
+    {
+      for (unsigned int channel = 0U; channel < channels; ++channel)
+       {
+         std::memcpy(out, &in[i], sizeof(Value));
+         out += sizeof(Value);
+       }
+    }
+ }
+
+// Convert up to a block of the mix to the format of the file: the clamping and scaling are done in one pass, with the vector kernels.
+static void encode (const Mix* in, size_t count, const Format& format, char* out)
+ {
+   if (16U == format.bits)
+    {
+#ifdef TD_SOUND_FIXED_POINT
+      interleave(in, count, format.channels, out);
+#else
+      short samples [blockSize];
+      TD_SOUND::getKernels().doubleToPCM16(in, samples, count);
+      interleave(samples, count, format.channels, out);
+#endif
+    }
+   else if (24U == format.bits)
+    {
+      int samples [blockSize];
+#ifdef TD_SOUND_FIXED_POINT
+      for (size_t i = 0U; i < count; ++i)
+       {
+         samples[i] = in[i] * 256;
+       }
+#else
+      TD_SOUND::getKernels().doubleToPCM24(in, samples, count);
+#endif
+      for (size_t i = 0U; i < count; ++i)
+       {
+         for (unsigned int channel = 0U; channel < format.channels; ++channel)
+          {
+            *out++ = static_cast<char>(samples[i]);
+            *out++ = static_cast<char>(samples[i] >> 8);
+            *out++ = static_cast<char>(samples[i] >> 16);
+          }
+       }
+    }
+   else // Float isn't clamped: it can hold what goes over.
+    {
+      float samples [blockSize];
+#ifdef TD_SOUND_FIXED_POINT
+      for (size_t i = 0U; i < count; ++i)
+       {
+         samples[i] = in[i] / 32767.0f;
+       }
+#else
+      TD_SOUND::getKernels().doubleToFloat(in, samples, count);
+#endif
+      interleave(samples, count, format.channels, out);
+    }
+ }
+
+// Like encode, for a stem.
+static void encodeStem (const Stem* in, size_t count, const Format& format, char* out)
+ {
+   for (size_t done = 0U; done < count; done += blockSize)
+    {
+      size_t length = std::min(blockSize, count - done);
+#ifdef TD_SOUND_FIXED_POINT
+      short block [blockSize];
+      for (size_t i = 0U; i < length; ++i)
+       {
+         block[i] = static_cast<short>(std::clamp(in[done + i], -32767, 32767));
+       }
+      encode(block, length, format, out + done * frameBytes(format));
+#else
+      encode(in + done, length, format, out + done * frameBytes(format));
+#endif
+    }
+ }
+
+// Render samples start to start + count of the song, a block at a time. Returns how many there were before the song ended.
+// This doesn't change the song, so any number of threads can render pieces of it at once.
+static size_t renderPiece (const TD_SOUND::Maestro& song, char* music, size_t start, size_t count, double step, const Format& format)
+ {
+   size_t done = 0U;
+   while (done < count)
+    {
+      size_t length = std::min(blockSize, count - done);
+      Mix block [blockSize];
+      size_t played = song.renderRange(block, length, start + done, step);
+      encode(block, played, format, music + done * frameBytes(format));
+      done += played;
+      if (played < length)
+       {
+         break;
+       }
+    }
+   return done;
+ }
+
+// Each round, each thread renders the next piece of the song: each piece is the same no matter who renders it, or when.
+// The rounds are written out as they are finished. Returns the number of samples.
+static uint64_t renderPieces (const TD_SOUND::Maestro& song, MusicWriter& output, unsigned int threads, double step, const Format& format)
+ {
+   size_t pieceBytes = pieceSize * frameBytes(format);
+   std::vector<char> music (pieceBytes * threads);
+   std::vector<size_t> played (threads);
+   uint64_t start = 0U;
+   size_t total = pieceSize * threads;
+   while (pieceSize * threads == total)
+    {
+      std::vector<std::thread> renderers;
+      for (unsigned int i = 1U; i < threads; ++i)
+       {
+         renderers.emplace_back([&, i]() { played[i] = renderPiece(song, &music[i * pieceBytes], start + i * pieceSize, pieceSize, step, format); });
+       }
+      played[0] = renderPiece(song, &music[0], start, pieceSize, step, format);
+      for (auto& renderer : renderers)
+       {
+         renderer.join();
+       }
+      // The song ends in the first piece that comes up short.
+      total = 0U;
+      for (size_t i = 0U; (i < threads) && (total == i * pieceSize); ++i)
+       {
+         total += played[i];
+       }
+      output.write(music.data(), total);
+      start += total;
+    }
+   return start;
+ }
+
+// A voice in the stem cache: either it was there, and is read back from it, or it is rendered and copied into it.
+struct CachedStem
+ {
+   std::string key;
+   std::ifstream from; // Open if the stem was in the cache.
+   std::filesystem::path partial; // If not, where it is copied as it is rendered.
+   std::ofstream to;
+   uint64_t samples; // How many have been copied.
+
+   CachedStem() : key(), from(), partial(), to(), samples(0U) { }
+ };
+
+// Render the next piece of a voice into a stem, or read it back from the stem cache. Returns how many samples there were.
+static size_t playStem (const TD_SOUND::Maestro& song, size_t voice, Stem* out, uint64_t start, double step, CachedStem* cached)
+ {
+   if ((nullptr != cached) && (true == cached->from.is_open()))
+    {
+      cached->from.read(reinterpret_cast<char*>(out), pieceSize * sizeof(Stem));
+      size_t played = static_cast<size_t>(cached->from.gcount()) / sizeof(Stem);
+      std::fill(out + played, out + pieceSize, Stem()); // As renderStem would.
+      return played;
+    }
+   size_t played = song.renderStem(voice, out, pieceSize, start, step);
+   if (nullptr != cached)
+    {
+      cached->to.write(reinterpret_cast<const char*>(out), played * sizeof(Stem));
+      cached->samples += played;
+    }
+   return played;
+ }
+
+// Each round, render the next piece of each voice on a thread of its own, into a stem, and then mix the stems.
+// If there are stem files, the stems are written to them. With a stem cache (one for each voice), the voices that are in it
+// are read back instead of rendered, and the rest are copied into it. Returns the number of samples.
+static uint64_t renderVoices (const TD_SOUND::Maestro& song, MusicWriter& output, std::vector<std::unique_ptr<MusicWriter> >& stems,
+   std::vector<CachedStem>* cached, double step, const Format& format)
+ {
+   size_t voices = song.voices();
+   std::vector<std::vector<Stem> > parts (voices, std::vector<Stem>(pieceSize));
+   std::vector<const Stem*> mixing (voices);
+   std::vector<size_t> played (voices);
+   std::vector<char> music (pieceSize * frameBytes(format));
+   uint64_t start = 0U;
+   size_t total = (0U == voices) ? 0U : pieceSize;
+   while (pieceSize == total)
+    {
+      std::vector<std::thread> renderers;
+      for (size_t i = 0U; i < voices; ++i)
+       {
+         renderers.emplace_back([&, i]() { played[i] = playStem(song, i, parts[i].data(), start, step, (nullptr == cached) ? nullptr : &(*cached)[i]); });
+       }
+      for (auto& renderer : renderers)
+       {
+         renderer.join();
+       }
+      // The song is finished once its longest voice is.
+      total = *std::max_element(played.begin(), played.end());
+      for (size_t first = 0U; first < total; first += blockSize)
+       {
+         size_t length = std::min(blockSize, total - first);
+         for (size_t i = 0U; i < voices; ++i)
+          {
+            mixing[i] = &parts[i][first];
+          }
+         Mix mixed [blockSize];
+         TD_SOUND::Maestro::mixStems(mixed, mixing.data(), voices, length);
+         encode(mixed, length, format, &music[first * frameBytes(format)]);
+       }
+      output.write(music.data(), total);
+      for (size_t i = 0U; i < stems.size(); ++i)
+       {
+         encodeStem(parts[i].data(), total, format, music.data());
+         stems[i]->write(music.data(), total);
+       }
+      start += total;
+    }
+   return start;
+ }
+
+/*
+   RenderCache keeps rendered files, so that music that hasn't changed isn't rendered again.
+   Each entry is named for a hash of everything that goes into the file: the music as the parser sees it, the engine, and the format.
+   The whole of that is kept next to the file, in a .key file, and checked on the way out, so that two entries with the same hash
+   can't be mixed up. Once the cache is bigger than its limit, the entries that were used longest ago are removed.
+   Stems have a limit of their own, as they are much bigger than the files, and would otherwise push all of them out.
+   A cache can be shared by threads, and by copies of MakeWave running at the same time: the worst they can do is miss.
+ */
+class RenderCache
+ {
+private:
+   std::filesystem::path directory;
+   uintmax_t limit;
+   uintmax_t stemLimit;
+   std::mutex evicting;
+   std::atomic<unsigned int> temporaries;
+
+   static std::string entryName(const std::string& key);
+   std::filesystem::path temporary(const std::string& entry);
+   bool readKey(const std::string& entry, const std::string& key, uint64_t& samples, size_t& stems);
+   bool writeKey(const std::string& entry, const std::string& key, uint64_t samples, size_t stems);
+   bool moveIn(const std::filesystem::path& partial, const std::string& name);
+   void touch(const std::string& entry);
+
+public:
+   std::atomic<size_t> hits;
+   std::atomic<size_t> misses;
+   std::atomic<size_t> evicted;
+   std::atomic<size_t> stemHits;
+   std::atomic<size_t> stemMisses;
+
+   // limit and stemLimit are in bytes.
+   RenderCache(const std::string& directory, uintmax_t limit, uintmax_t stemLimit);
+
+   bool good() const;
+   // Copy the entry for key to output, and its stems to stems (if there are any). Returns false if there isn't one.
+   bool fetch(const std::string& key, const std::string& output, const std::vector<std::string>& stems, uint64_t& samples);
+   // Copy output and stems into the cache as the entry for key.
+   void store(const std::string& key, const std::string& output, const std::vector<std::string>& stems, uint64_t samples);
+
+   // The stem cache keeps each voice, unmixed, so that when only some of the voices of a song change, only they are rendered.
+   // Open the stem for key to be read, if it is there, and returns true. If it isn't, opens a file to copy it into as it is rendered.
+   bool openStem(const std::string& key, CachedStem& stem);
+   // Once the stem has been rendered, put it in the cache (if keep), or throw it away.
+   void finishStem(CachedStem& stem, bool keep);
+
+   // Remove the entries that were used longest ago until the cache fits, but never those for keys (everything a render just used).
+   void evict(const std::vector<std::string>& keys);
+ };
+
+RenderCache::RenderCache(const std::string& directory, uintmax_t limit, uintmax_t stemLimit) :
+   directory(directory), limit(limit), stemLimit(stemLimit), evicting(), temporaries(0U), hits(0U), misses(0U), evicted(0U), stemHits(0U), stemMisses(0U)
+ {
+   std::error_code error;
+   std::filesystem::create_directories(this->directory, error);
+ }
+
+bool RenderCache::good() const
+ {
+   std::error_code error;
+   return std::filesystem::is_directory(directory, error);
+ }
+
+// The 64-bit FNV-1a hash of the key, in hex.
+std::string RenderCache::entryName(const std::string& key)
+ {
+   uint64_t hash = 0xCBF29CE484222325U;
+   for (char c : key)
+    {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001B3U;
+    }
+   std::ostringstream name;
+   name << std::hex << std::setw(16) << std::setfill('0') << hash;
+   return name.str();
+ }
+
+// A name to write to before renaming, that no other thread or process will be using.
+std::filesystem::path RenderCache::temporary(const std::string& entry)
+ {
+   std::ostringstream name;
+   name << entry << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << "." <<
+      std::chrono::steady_clock::now().time_since_epoch().count() << "." << temporaries++ << ".tmp";
+   return directory / name.str();
+ }
+
+// Whether the entry's .key file holds key, and if so, what else it says.
+bool RenderCache::readKey(const std::string& entry, const std::string& key, uint64_t& samples, size_t& stems)
+ {
+   std::string found;
+   std::ifstream file (directory / (entry + ".key"), std::ios::in | std::ios::binary);
+   if ((file >> samples >> stems) && ('\n' == file.get()))
+    {
+      std::ostringstream rest;
+      rest << file.rdbuf();
+      found = rest.str();
+    }
+   return key == found;
+ }
+
+// Write the .key file, which makes the entry. This goes last: until it is there, the entry isn't.
+bool RenderCache::writeKey(const std::string& entry, const std::string& key, uint64_t samples, size_t stems)
+ {
+   std::filesystem::path partial = temporary(entry);
+   bool written;
+    {
+      std::ofstream file (partial, std::ios::out | std::ios::binary);
+      file << samples << " " << stems << "\n" << key;
+      written = file.good();
+    }
+   if (true == written)
+    {
+      return moveIn(partial, entry + ".key");
+    }
+   std::error_code error;
+   std::filesystem::remove(partial, error);
+   return false;
+ }
+
+// Rename a finished temporary file to its name in the cache, so that no one copies out half a file.
+bool RenderCache::moveIn(const std::filesystem::path& partial, const std::string& name)
  {
-   if (argc != 3)
+   std::error_code error;
+   std::filesystem::rename(partial, directory / name, error);
+   if (error)
     {
-      std::cout << "MakeWave version 1.0 : Copyright 2021 Thomas DiModica" << std::endl <<
-         "usage: MakeWave <input file> <output file>" << std::endl <<
-         "MakeWave converts text music in Music Markup Language to WAV files." << std::endl << std::endl;
-      return 1;
+      std::filesystem::remove(partial, error);
+      return false;
+    }
+   return true;
+ }
+
+// Mark the entry as just used, so it is the last to go.
+void RenderCache::touch(const std::string& entry)
+ {
+   std::error_code error;
+   std::filesystem::last_write_time(directory / (entry + ".key"), std::filesystem::file_time_type::clock::now(), error);
+ }
+
+bool RenderCache::fetch(const std::string& key, const std::string& output, const std::vector<std::string>& stems, uint64_t& samples)
+ {
+   std::string entry = entryName(key);
+   size_t stored = 0U;
+   // An entry without stems can't be used when they are wanted. Stems are only kept when there is one for each voice.
+   bool hit = (true == readKey(entry, key, samples, stored)) && ((true == stems.empty()) || (stems.size() == stored));
+   std::error_code error;
+   if (true == hit)
+    {
+      hit = std::filesystem::copy_file(directory / (entry + ".music"), output, std::filesystem::copy_options::overwrite_existing, error);
+      for (size_t i = 0U; (true == hit) && (i < stems.size()); ++i)
+       {
+         hit = std::filesystem::copy_file(directory / (entry + ".voice" + std::to_string(i + 1U)), stems[i],
+            std::filesystem::copy_options::overwrite_existing, error);
+       }
+    }
+   if (true == hit)
+    {
+      touch(entry);
+      ++hits;
+    }
+   else
+    {
+      ++misses;
+    }
+   return hit;
+ }
+
+void RenderCache::store(const std::string& key, const std::string& output, const std::vector<std::string>& stems, uint64_t samples)
+ {
+   std::string entry = entryName(key);
+   auto copyIn = [&](const std::string& from, const std::string& to)
+    {
+      std::filesystem::path partial = temporary(entry);
+      std::error_code error;
+      if (false == std::filesystem::copy_file(from, partial, error))
+       {
+         std::filesystem::remove(partial, error);
+         return false;
+       }
+      return moveIn(partial, entry + to);
+    };
+   bool stored = copyIn(output, ".music");
+   for (size_t i = 0U; (true == stored) && (i < stems.size()); ++i)
+    {
+      stored = copyIn(stems[i], ".voice" + std::to_string(i + 1U));
+    }
+   if (true == stored)
+    {
+      writeKey(entry, key, samples, stems.size());
+    }
+ }
+
+bool RenderCache::openStem(const std::string& key, CachedStem& stem)
+ {
+   std::string entry = entryName(key);
+   uint64_t samples = 0U;
+   size_t unused = 0U;
+   std::error_code error;
+   stem.key = key;
+   // Check the size too: a stem that is cut short would be silence, and no one would know.
+   if ((true == readKey(entry, key, samples, unused)) &&
+      (samples * sizeof(Stem) == std::filesystem::file_size(directory / (entry + ".stem"), error)) && (!error))
+    {
+      stem.from.open(directory / (entry + ".stem"), std::ios::in | std::ios::binary);
+      if (true == stem.from.is_open())
+       {
+         touch(entry);
+         ++stemHits;
+         return true;
+       }
+    }
+   ++stemMisses;
+   stem.partial = temporary(entry);
+   stem.to.open(stem.partial, std::ios::out | std::ios::binary);
+   return false;
+ }
+
+void RenderCache::finishStem(CachedStem& stem, bool keep)
+ {
+   if (true == stem.to.is_open())
+    {
+      stem.to.close();
+      std::string entry = entryName(stem.key);
+      if ((true == keep) && (false == stem.to.fail()) && (true == moveIn(stem.partial, entry + ".stem")))
+       {
+         writeKey(entry, stem.key, stem.samples, 0U);
+       }
+      else
+       {
+         std::error_code error;
+         std::filesystem::remove(stem.partial, error);
+       }
+    }
+ }
+
+// Files are grouped into entries by the hash at the start of their names. An entry is as old as its .key file,
+// and is a stem if it has a .stem file. Files that are still being copied in don't count.
+void RenderCache::evict(const std::vector<std::string>& keys)
+ {
+   struct Entry
+    {
+      std::filesystem::file_time_type used;
+      uintmax_t size;
+      bool stem;
+      std::vector<std::filesystem::path> files;
+    };
+   std::lock_guard<std::mutex> lock (evicting);
+   std::set<std::string> keep;
+   for (const std::string& key : keys)
+    {
+      keep.insert(entryName(key));
+    }
+   std::map<std::string, Entry> entries;
+   std::error_code error;
+   for (const auto& file : std::filesystem::directory_iterator(directory, error))
+    {
+      if (false == file.is_regular_file(error))
+       {
+         continue;
+       }
+      std::string name = file.path().filename().string();
+      std::string entry = name.substr(0U, name.find('.'));
+      uintmax_t size = file.file_size(error);
+      std::filesystem::file_time_type used = file.last_write_time(error);
+      if (error)
+       {
+         continue;
+       }
+      // Someone is still copying this in. If it is old, though, whoever it was didn't finish.
+      if ((".tmp" == file.path().extension()) && (std::filesystem::file_time_type::clock::now() - used < std::chrono::hours(1)))
+       {
+         continue;
+       }
+      auto found = entries.find(entry);
+      if (entries.end() == found)
+       {
+         found = entries.emplace(entry, Entry { std::filesystem::file_time_type::min(), 0U, false, { } }).first;
+       }
+      if ((".key" == file.path().extension()) || (std::filesystem::file_time_type::min() == found->second.used))
+       {
+         found->second.used = used;
+       }
+      found->second.stem |= (".stem" == file.path().extension());
+      found->second.size += size;
+      found->second.files.push_back(file.path());
+    }
+   // Each kind is trimmed to its own limit.
+   for (bool stems : { false, true })
+    {
+      uintmax_t total = 0U;
+      std::vector<std::pair<std::filesystem::file_time_type, std::string> > oldest;
+      for (const auto& entry : entries)
+       {
+         if (stems == entry.second.stem)
+          {
+            total += entry.second.size;
+            if (0U == keep.count(entry.first))
+             {
+               oldest.emplace_back(entry.second.used, entry.first);
+             }
+          }
+       }
+      std::sort(oldest.begin(), oldest.end());
+      for (size_t i = 0U; (total > ((true == stems) ? stemLimit : limit)) && (i < oldest.size()); ++i)
+       {
+         const Entry& entry = entries.at(oldest[i].second);
+         for (const auto& file : entry.files)
+          {
+            std::filesystem::remove(file, error);
+          }
+         total -= entry.size;
+         ++evicted;
+       }
+    }
+ }
+
+// The music as the parser sees it: it skips spaces, and doesn't care about case.
+static std::string normalize (const std::string& voice)
+ {
+   std::string music;
+   for (char c : voice)
+    {
+      if (0 == std::isspace(static_cast<unsigned char>(c)))
+       {
+         music.push_back(static_cast<char>(std::toupper(static_cast<unsigned char>(c))));
+       }
+    }
+   return music;
+ }
+
+// Everything that goes into a rendered file, for the cache. The parser skips spaces and doesn't care about case, so neither does this,
+// and empty voices are thrown out, so they are here too. MakeWave uses the engine's own instruments, so the engine's version covers them.
+static std::string cacheKey (const std::vector<std::string>& voices, const Format& format, bool flac)
+ {
+   std::ostringstream key;
+   key << engineVersion << ((sizeof(Stem) == sizeof(int)) ? " fixed point, " : " floating point, ") << TD_SOUND::getKernels().name << " kernels\n" << format.samplerate << " " << format.bits << " " << format.channels << " " <<
+      ((true == flac) ? "FLAC" : "WAV") << "\n";
+   for (const std::string& voice : voices)
+    {
+      std::string music = normalize(voice);
+      if (false == music.empty())
+       {
+         key << music << "\n";
+       }
+    }
+   return key.str();
+ }
+
+// Everything that goes into a stem, for the stem cache: the voice and the sample rate. The format is applied after mixing.
+static std::string stemKey (const std::string& voice, int samplerate)
+ {
+   std::ostringstream key;
+   key << engineVersion << ((sizeof(Stem) == sizeof(int)) ? " fixed point" : " floating point") << " stem, " <<
+      TD_SOUND::getKernels().name << " kernels\n" << samplerate << "\n" << normalize(voice) << "\n";
+   return key.str();
+ }
+
+struct Settings
+ {
+   unsigned int threads; // In batch mode, this is how many files are rendered at once, and each file gets one.
+   bool byVoice;
+   bool writeStems;
+   Format format;
+   int flac; // 1 for FLAC, 0 for WAV, or -1 to go by the output file's name.
+   RenderCache* cache; // Or nullptr, for no cache.
+   bool byStem; // Keep each voice in the cache too, and only render the voices that aren't there. Needs a cache, and byVoice.
+ };
+
+static bool endsWith (const std::string& name, const std::string& ending)
+ {
+   return (name.size() >= ending.size()) && (0 == name.compare(name.size() - ending.size(), ending.size(), ending));
+ }
+
+static std::unique_ptr<MusicWriter> makeWriter (const std::string& name, const Format& format, uint64_t expected, bool flac)
+ {
+   if (true == flac)
+    {
+      return std::unique_ptr<MusicWriter>(new FlacWriter(name, format));
     }
+   return std::unique_ptr<MusicWriter>(new WaveWriter(name, format, expected));
+ }
 
+// What makeWave made.
+struct Rendered
+ {
+   size_t voices;
+   unsigned int threads;
+   uint64_t samples;
+   double length; // In seconds.
+   bool cached; // It was copied from the cache, rather than rendered.
+ };
+
+// Render the input file to the output file. Returns zero, or the exit code for what went wrong, after writing what it was to errors.
+static int makeWave (const std::string& input, const std::string& outputName, const Settings& settings, std::ostream& errors, Rendered& result)
+ {
    std::vector<std::string> voices;
     {
       std::string toPlay;
-      std::ifstream music (argv[1]);
+      std::ifstream music (input);
       if (false == music.good())
        {
-         std::cerr << "Error opening file: " << argv[1] << std::endl;
+         errors << "Error opening file: " << input << std::endl;
          return 2;
        }
       toPlay = "";
@@ -72,65 +1576,464 @@ int main (int argc, char ** argv)
     }
    if (true == voices.empty())
     {
-      std::cerr << "Error reading file, file contained no text: " << argv[1] << std::endl;
+      errors << "Error reading file, file contained no text: " << input << std::endl;
       return 2;
     }
 
+   // This is what the Maestro does with the music, but it remembers which line each voice that is left came from.
+   TD_SOUND::Maestro song;
+   std::vector<std::string> sung;
    try
     {
-      TD_SOUND::Venue::getInstance().queueMusic(voices);
+      std::vector<TD_SOUND::Voice> choir;
+      for (const std::string& voice : voices)
+       {
+         choir.emplace_back(TD_SOUND::buildVoiceFromString(voice));
+         if (true == choir.back().finished()) // Throw out empty voices.
+          {
+            choir.pop_back();
+          }
+         else
+          {
+            sung.push_back(voice);
+          }
+       }
+      song = TD_SOUND::Maestro(choir);
     }
    catch (const std::invalid_argument& e)
     {
-      std::cerr << "Error parsing music file: " << e.what() << std::endl;
+      errors << "Error parsing music file: " << e.what() << std::endl;
       return 3;
     }
 
-   bool done = false;
-   TD_SOUND::Venue::getInstance().addMusicCallback([&](){ done = true; });
+   const Format& format = settings.format;
+   const double step = 1.0 / format.samplerate;
+   bool flac = (-1 == settings.flac) ? (true == endsWith(outputName, ".flac")) : (1 == settings.flac);
+   if ((true == flac) && (32U == format.bits))
+    {
+      errors << "FLAC can't hold float samples: " << outputName << std::endl;
+      return 4;
+    }
+   std::vector<std::string> stemNames;
+   if (true == settings.writeStems)
+    {
+      for (size_t i = 0U; i < song.voices(); ++i)
+       {
+         stemNames.push_back(outputName + ".voice" + std::to_string(i + 1U) + ((true == flac) ? ".flac" : ".wav"));
+       }
+    }
+
+   result.voices = voices.size();
+   result.cached = false;
+   // Standard output can't be copied into the cache afterwards, so it doesn't use it.
+   bool caching = (nullptr != settings.cache) && ("-" != outputName);
+   std::string key;
+   if (true == caching)
+    {
+      key = cacheKey(voices, format, flac);
+      if (true == settings.cache->fetch(key, outputName, stemNames, result.samples))
+       {
+         result.threads = 0U;
+         result.length = static_cast<double>(result.samples) / format.samplerate;
+         result.cached = true;
+         return 0;
+       }
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   song.fix(format.samplerate); // Before the threads share it.
+#endif
+   // The song finishes on the first sample after its length.
+   uint64_t expected = static_cast<uint64_t>(song.length() / step) + 2U;
+   std::unique_ptr<MusicWriter> writer = makeWriter(outputName, format, expected, flac);
+   MusicWriter& output = *writer;
+   std::vector<std::unique_ptr<MusicWriter> > stems;
+   for (const std::string& name : stemNames)
+    {
+      stems.push_back(makeWriter(name, format, expected, flac));
+    }
+   std::vector<CachedStem> cachedStems;
+   bool byStem = (nullptr != settings.cache) && (true == settings.byStem);
+   if (true == byStem)
+    {
+      cachedStems = std::vector<CachedStem>(song.voices());
+      for (size_t i = 0U; i < song.voices(); ++i)
+       {
+         settings.cache->openStem(stemKey(sung[i], format.samplerate), cachedStems[i]);
+       }
+    }
+   if (false == output.good())
+    {
+      errors << "Error opening file: " << outputName << std::endl;
+      return 4;
+    }
+   for (auto& stem : stems)
+    {
+      if (false == stem->good())
+       {
+         errors << "Error opening a stem file for: " << outputName << std::endl;
+         return 4;
+       }
+    }
+
+   if (true == settings.byVoice)
+    {
+      result.threads = static_cast<unsigned int>(song.voices());
+      result.samples = renderVoices(song, output, stems, (true == byStem) ? &cachedStems : nullptr, step, format);
+    }
+   else
+    {
+      result.threads = settings.threads;
+      result.samples = renderPieces(song, output, settings.threads, step, format);
+    }
+   result.length = static_cast<double>(result.samples) / format.samplerate;
+
+   bool written = output.finish();
+   for (auto& stem : stems)
+    {
+      written &= stem->finish();
+    }
+   for (auto& stem : cachedStems)
+    {
+      settings.cache->finishStem(stem, written);
+    }
+   if (false == written)
+    {
+      errors << "Error writing file: " << outputName << std::endl;
+      return 4;
+    }
+   // Everything is in the cache before anything is removed from it, so that this song's own voices aren't.
+   std::vector<std::string> used;
+   if (true == caching)
+    {
+      settings.cache->store(key, outputName, stemNames, result.samples);
+      used.push_back(key);
+    }
+   for (const auto& stem : cachedStems)
+    {
+      used.push_back(stem.key);
+    }
+   if (false == used.empty())
+    {
+      settings.cache->evict(used);
+    }
+   return 0;
+ }
+
+// The output file for an input file: the same name, ending in .wav (or .flac) instead.
+static std::string outputFor (const std::string& input, const std::string& extension)
+ {
+   std::filesystem::path path (input);
+   path.replace_extension(extension);
+   return path.string();
+ }
 
-   const int samplerate = 44100;
-   const double step = 1.0 / samplerate;
-   std::vector<short> music;
+// Read the list of files to render: every .txt file in a directory, or a manifest with a file on each line.
+// Each line of a manifest is an input file, and optionally a tab and the output file. Empty lines and lines starting with # are skipped.
+// (Not /, as in the music: that would skip every absolute path.)
+static bool readBatch (const std::string& name, const std::string& extension, std::vector<std::pair<std::string, std::string> >& jobs)
+ {
+   std::error_code error;
+   if (true == std::filesystem::is_directory(name, error))
+    {
+      for (const auto& entry : std::filesystem::directory_iterator(name, error))
+       {
+         if ((true == entry.is_regular_file(error)) && (".txt" == entry.path().extension()))
+          {
+            jobs.emplace_back(entry.path().string(), outputFor(entry.path().string(), extension));
+          }
+       }
+      std::sort(jobs.begin(), jobs.end());
+      return !error;
+    }
+   std::ifstream manifest (name);
+   if (false == manifest.good())
     {
-      size_t sample = 0U;
+      return false;
+    }
+   std::string line;
+   while (std::getline(manifest, line))
+    {
+      if ((false == line.empty()) && ('\r' == line.back()))
+       {
+         line.pop_back();
+       }
+      if ((false == line.empty()) && ('#' != line[0]))
+       {
+         size_t tab = line.find('\t');
+         if (std::string::npos == tab)
+          {
+            jobs.emplace_back(line, outputFor(line, extension));
+          }
+         else
+          {
+            jobs.emplace_back(line.substr(0U, tab), line.substr(tab + 1U));
+          }
+       }
+    }
+   return true;
+ }
 
-      while (false == done)
+static void reportCache (const RenderCache* cache, std::ostream& report)
+ {
+   if (nullptr != cache)
+    {
+      report << "Cache: " << cache->hits << " hits, " << cache->misses << " misses, " << cache->evicted << " removed" << std::endl;
+      if (0U != cache->stemHits + cache->stemMisses)
        {
-         double curTime = static_cast<double>(sample) / samplerate;
-         double thisSample = std::clamp(TD_SOUND::Venue::sdGetSample(0, curTime, step), -1.0, 1.0);
-         short curSample = static_cast<short>(thisSample * (std::numeric_limits<short>::max)());
-         music.push_back(curSample);
+         report << "Voices: " << cache->stemHits << " from the cache, " << cache->stemMisses << " rendered" << std::endl;
        }
     }
+ }
 
-   std::cout << "Voices found (empty voices are counted here, but may have been removed): " << voices.size() << std::endl <<
-      "Samples generated: " << music.size() << std::endl <<
-      "Length: " << (static_cast<double>(music.size()) / samplerate) << std::endl;
+// Render every file in the batch, each on one thread of a pool. Each thread takes the next file as soon as it is done with one,
+// so a long song doesn't hold up the rest. Keeps going past files that fail, and lists them at the end.
+static int makeBatch (const std::string& name, const Settings& settings)
+ {
+   std::vector<std::pair<std::string, std::string> > jobs;
+   if (false == readBatch(name, (1 == settings.flac) ? ".flac" : ".wav", jobs))
+    {
+      std::cerr << "Error reading batch: " << name << std::endl;
+      return 2;
+    }
+   if (true == jobs.empty())
+    {
+      std::cerr << "Error reading batch, there was nothing in it to render: " << name << std::endl;
+      return 2;
+    }
+   // Start with the biggest files, so that the last one to finish isn't a long one.
+   std::vector<std::pair<uintmax_t, size_t> > order;
+   for (size_t i = 0U; i < jobs.size(); ++i)
+    {
+      std::error_code error;
+      uintmax_t size = std::filesystem::file_size(jobs[i].first, error);
+      order.emplace_back((error) ? 0U : size, i);
+    }
+   std::sort(order.begin(), order.end(), [](const auto& lhs, const auto& rhs) { return lhs.first > rhs.first; });
 
+   Settings each = settings;
+   each.threads = 1U;
+   std::vector<std::string> failures (jobs.size());
+   std::atomic<size_t> next (0U);
+   std::mutex reporting;
+   auto work = [&]()
     {
-      std::ofstream fileout (argv[2], std::ios::out | std::ios::binary);
-      if (false == fileout.good())
+      for (size_t taken = next++; taken < order.size(); taken = next++)
        {
-         std::cerr << "Error opening file: " << argv[1] << std::endl;
-         return 4;
+         size_t job = order[taken].second;
+         Rendered result = { 0U, 0U, 0U, 0.0, false };
+         std::ostringstream errors;
+         auto start = std::chrono::steady_clock::now();
+         int code = ("-" == jobs[job].second) ? 1 : makeWave(jobs[job].first, jobs[job].second, each, errors, result);
+         double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+         std::lock_guard<std::mutex> lock (reporting);
+         if (0 == code)
+          {
+            if (true == result.cached)
+             {
+               std::cout << jobs[job].first << ": " << result.length << " seconds of music, from the cache" << std::endl;
+             }
+            else
+             {
+               std::cout << jobs[job].first << ": " << result.length << " seconds of music in " << seconds << " seconds (" <<
+                  (result.length / std::max(seconds, 1e-9)) << " times real time)" << std::endl;
+             }
+          }
+         else
+          {
+            failures[job] = (1 == code) ? "Can't write to standard output in a batch.\n" : errors.str();
+            std::cout << jobs[job].first << ": failed" << std::endl;
+          }
+       }
+    };
+   unsigned int threads = std::max(1U, std::min(settings.threads, static_cast<unsigned int>(jobs.size())));
+   auto start = std::chrono::steady_clock::now();
+    {
+      std::vector<std::thread> pool;
+      for (unsigned int i = 1U; i < threads; ++i)
+       {
+         pool.emplace_back(work);
+       }
+      work();
+      for (auto& thread : pool)
+       {
+         thread.join();
+       }
+    }
+   double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+   size_t failed = 0U;
+   for (size_t i = 0U; i < jobs.size(); ++i)
+    {
+      if (false == failures[i].empty())
+       {
+         std::cerr << jobs[i].first << ": " << failures[i];
+         ++failed;
+       }
+    }
+   std::cout << "Kernels used: " << TD_SOUND::getKernels().name << std::endl <<
+      "Threads used: " << threads << std::endl <<
+      "Files rendered: " << (jobs.size() - failed) << " of " << jobs.size() << " in " << seconds << " seconds" << std::endl;
+   reportCache(settings.cache, std::cout);
+   return (0U == failed) ? 0 : 5;
+ }
+
+int main (int argc, char ** argv)
+ {
+   Settings settings = { 0U, false, false, { 44100, 16U, 1U }, -1, nullptr, false };
+   bool batch = false;
+   std::string cacheDirectory;
+   long long cacheMegabytes = 1024;
+   long long stemMegabytes = 4096;
+   int arg = 1;
+   bool good = true;
+   while ((true == good) && (arg < argc) && ('-' == argv[arg][0]) && ('\0' != argv[arg][1]))
+    {
+      std::string option = argv[arg];
+      if (("-j" == option) && (arg + 1 < argc))
+       {
+         int threads = std::atoi(argv[arg + 1]);
+         settings.threads = static_cast<unsigned int>(std::max(threads, 0));
+         good = (0 < threads);
+         ++arg;
+       }
+      else if ("-v" == option)
+       {
+         settings.byVoice = true;
+       }
+      else if ("-s" == option)
+       {
+         settings.byVoice = true;
+         settings.writeStems = true;
+       }
+      else if ("-b" == option)
+       {
+         batch = true;
+       }
+      else if (("-r" == option) && (arg + 1 < argc))
+       {
+         settings.format.samplerate = std::atoi(argv[arg + 1]);
+         good = (22050 <= settings.format.samplerate) && (settings.format.samplerate <= 192000);
+         ++arg;
+       }
+      else if (("-d" == option) && (arg + 1 < argc))
+       {
+         settings.format.bits = static_cast<unsigned int>(std::max(std::atoi(argv[arg + 1]), 0));
+         good = (16U == settings.format.bits) || (24U == settings.format.bits) || (32U == settings.format.bits);
+         ++arg;
+       }
+      else if (("-c" == option) && (arg + 1 < argc))
+       {
+         settings.format.channels = static_cast<unsigned int>(std::max(std::atoi(argv[arg + 1]), 0));
+         good = (1U <= settings.format.channels) && (settings.format.channels <= 8U);
+         ++arg;
+       }
+      else if (("-k" == option) && (arg + 1 < argc))
+       {
+         cacheDirectory = argv[arg + 1];
+         good = (false == cacheDirectory.empty());
+         ++arg;
+       }
+      else if ("-i" == option)
+       {
+         settings.byVoice = true;
+         settings.byStem = true;
+       }
+      else if (("-m" == option) && (arg + 1 < argc))
+       {
+         cacheMegabytes = std::atoll(argv[arg + 1]);
+         good = (0 < cacheMegabytes);
+         ++arg;
+       }
+      else if (("-M" == option) && (arg + 1 < argc))
+       {
+         stemMegabytes = std::atoll(argv[arg + 1]);
+         good = (0 < stemMegabytes);
+         ++arg;
+       }
+      else if (("-f" == option) && (arg + 1 < argc))
+       {
+         std::string type = argv[arg + 1];
+         settings.flac = ("flac" == type) ? 1 : 0;
+         good = ("flac" == type) || ("wav" == type);
+         ++arg;
+       }
+      else
+       {
+         good = false;
+       }
+      ++arg;
+    }
+   good &= (argc - arg == ((true == batch) ? 1 : 2));
+   good &= ((false == settings.byStem) || (false == cacheDirectory.empty()));
+   if ((true == good) && (false == batch) && (true == settings.writeStems))
+    {
+      good = (std::string("-") != argv[arg + 1]);
+    }
+   if (false == good)
+    {
+      std::cout << "MakeWave version 1.0 : Copyright 2021 Thomas DiModica" << std::endl <<
+         "usage: MakeWave [-j <threads>] [-v] [-s] [-r <rate>] [-d <bits>] [-c <channels>] [-f <wav or flac>] [-k <cache directory> [-m <megabytes>] [-i [-M <megabytes>]]]" << std::endl <<
+         "                <input file> <output file>" << std::endl <<
+         "       MakeWave [-j <threads>] [-v] [-s] [-r <rate>] [-d <bits>] [-c <channels>] [-f <wav or flac>] [-k <cache directory> [-m <megabytes>] [-i [-M <megabytes>]]]" << std::endl <<
+         "                -b <manifest file or directory>" << std::endl <<
+         "MakeWave converts text music in Music Markup Language to WAV (or FLAC) files." << std::endl <<
+         "An output file ending in .flac is written as FLAC, unless -f says otherwise. FLAC can't hold float (-d 32)." << std::endl <<
+         "By default, the file is 44100 samples a second (-r: 22050 to 192000), 16 bits (-d: 16, 24, or 32 for float), and mono (-c: 1 to 8)." << std::endl <<
+         "With -j, the song is split into that many pieces, which are rendered at the same time." << std::endl <<
+         "With -v, each voice is rendered at the same time, on a thread of its own." << std::endl <<
+         "With -s, each voice is also written to a WAV file of its own (a stem): <output file>.voice1.wav, and so on." << std::endl <<
+         "If the output file is -, the WAV file is written to standard output (but the stems can't be)." << std::endl <<
+         "With -b, every .txt file in the directory is converted to a .wav (or, with -f flac, .flac) file next to it, or every file listed in the manifest is." << std::endl <<
+         "Each line of a manifest is an input file, and optionally a tab and the output file. Lines starting with # are skipped." << std::endl <<
+         "In a batch, -j is how many files are converted at once: by default, one for each processor." << std::endl <<
+         "With -k, rendered files are kept in the cache directory, and music that has been rendered before is copied from there." << std::endl <<
+         "The cache is kept under -m megabytes (by default, 1024) by removing what was used longest ago." << std::endl <<
+         "With -i, each voice is kept in the cache too, so that when only some voices change, only they are rendered again (this implies -v)." << std::endl <<
+         "The voices are kept under -M megabytes of their own (by default, 4096)." << std::endl << std::endl;
+      return 1;
+    }
+
+   std::unique_ptr<RenderCache> cache;
+   if (false == cacheDirectory.empty())
+    {
+      cache.reset(new RenderCache(cacheDirectory, static_cast<uintmax_t>(cacheMegabytes) * 1024U * 1024U,
+         static_cast<uintmax_t>(stemMegabytes) * 1024U * 1024U));
+      if (false == cache->good())
+       {
+         std::cerr << "Error opening cache directory: " << cacheDirectory << std::endl;
+         return 2;
+       }
+      settings.cache = cache.get();
+    }
+
+   if (true == batch)
+    {
+      if (0U == settings.threads)
+       {
+         settings.threads = std::max(1U, std::thread::hardware_concurrency());
        }
-      fileout.write("RIFF", 4);
-      unsigned int samplesSize = 2U * static_cast<unsigned int>(music.size());
-      unsigned int dataLength = 36U + samplesSize;
-      fileout.write(static_cast<char*>(static_cast<void*>(&dataLength)), 4);
-      fileout.write("WAVE", 4);
-      fileout.write("fmt ", 4);
-      fileout.write("\x10\0\0\0", 4); // Size of header : 16
-      fileout.write("\1\0\1\0", 4); // Format : 1 = PCM, Channels : 1
-      fileout.write(static_cast<const char*>(static_cast<const void*>(&samplerate)), 4);
-      unsigned int byterate = 1U /*num channels*/ * static_cast<unsigned int>(samplerate) * 2U /* bytes per sample */;
-      fileout.write(static_cast<char*>(static_cast<void*>(&byterate)), 4);
-      fileout.write("\2\0\x10\0", 4); // Block align : 1 channel * 2 bytes per sample, Bits per sample : 16
-      fileout.write("data", 4);
-      fileout.write(static_cast<char*>(static_cast<void*>(&samplesSize)), 4);
-      fileout.write(static_cast<char*>(static_cast<void*>(&(music[0]))), samplesSize);
+      return makeBatch(argv[arg], settings);
     }
 
+   settings.threads = std::max(1U, settings.threads);
+   std::string input = argv[arg];
+   std::string output = argv[arg + 1];
+   // If the music is going to standard output, the rest can't.
+   std::ostream& report = ("-" == output) ? std::cerr : std::cout;
+   Rendered result = { 0U, 0U, 0U, 0.0, false };
+   int code = makeWave(input, output, settings, std::cerr, result);
+   if (0 != code)
+    {
+      return code;
+    }
+
+   report << "Kernels used: " << TD_SOUND::getKernels().name << std::endl <<
+      "Threads used: " << result.threads << std::endl <<
+      "Voices found (empty voices are counted here, but may have been removed): " << result.voices << std::endl <<
+      "Samples generated: " << result.samples << std::endl <<
+      "Length: " << result.length << std::endl;
+   reportCache(settings.cache, report);
+
    return 0;
  }
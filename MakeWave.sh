@@ -2,3 +2,4 @@
 
 x86_64-w64-mingw32-g++.exe -s -O2 -std=c++17 -o MakeWave -Weffc++ -Wall -Wextra -Wpedantic MakeWave.cpp
 #x86_64-w64-mingw32-g++.exe -g -std=c++17 -o Program -Wall -Wextra -Wpedantic main.cpp
+#x86_64-w64-mingw32-g++.exe -s -O2 -std=c++17 -o MakeWave -DTD_SOUND_FIXED_POINT -Weffc++ -Wall -Wextra -Wpedantic MakeWave.cpp
@@ -43,6 +43,7 @@ followed by the entire license text.
 #define TD_SOUND_ENGINE_H
 
 #include <cmath>
+#include <cstdint>
 #include <functional>
 #include <limits>
 #include <vector>
@@ -52,13 +53,65 @@ followed by the entire license text.
 #include <list>
 #include <map>
 #include <stdexcept>
+#include <mutex>
+#include <tuple>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <array>
+
+#if defined(TD_SOUND_IMPLEMENTATION) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TD_SOUND_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 namespace TD_SOUND
  {
 
+   /*
+      Everything from mixing notes together on out is templated on the type of the sample produced.
+      The implementation provides float and double: float for playing music, double for when you want to be picky.
+      Oscillators and envelopes are still called with, and return, double: time is always kept in double,
+      as a float can't tell one sample from the next a few minutes into a song.
+
+      Define TD_SOUND_FIXED_POINT to also get a short (16-bit PCM) version of render, for machines without a fast FPU.
+      That version keeps time in samples, phase in Q32 (a full cycle is 2^32), and oscillators, envelopes, and volumes in Q15.
+      The built-in oscillators and the default envelope have integer versions. Yours will too, if you write them (see below).
+    */
+
    const std::vector<double>& getStandardTwelveToneEqualNotes();
    const std::vector<std::string>& getNoteNames();
 
+   /*
+      The loops that work on whole buffers of samples.
+      The first call to getKernels picks the best versions that this machine can run: "avx512", "avx2", "sse2", or "scalar".
+      The vector versions are only compiled by GCC and Clang for x86: everyone else gets "scalar".
+      toPCM16 clamps to [-1.0, 1.0] and then scales and truncates, exactly as MakeWave always has.
+      toPCM24 does the same, for 24 bits, each in the low bits of an int. doubleToFloat doesn't clamp: float can go over.
+    */
+   struct Kernels
+    {
+      const char * name;
+      void (*addFloat)(float* out, const float* in, size_t count);
+      void (*addDouble)(double* out, const double* in, size_t count);
+      void (*scaleFloat)(float* out, float gain, size_t count);
+      void (*scaleDouble)(double* out, double gain, size_t count);
+      void (*floatToPCM16)(const float* in, short* out, size_t count);
+      void (*doubleToPCM16)(const double* in, short* out, size_t count);
+      void (*floatToPCM24)(const float* in, int* out, size_t count);
+      void (*doubleToPCM24)(const double* in, int* out, size_t count);
+      void (*doubleToFloat)(const double* in, float* out, size_t count);
+    };
+
+   const Kernels& getKernels();
+   // Names of the versions that this machine can run, best first.
+   std::vector<std::string> getAvailableKernels();
+   // Use a particular version (to compare them, or to work around a problem). Returns false if this machine can't run it.
+   // This is for every Venue at once. Music that is playing switches over with the next block.
+   bool useKernels(const std::string& name);
+
    /*
       To implement your own oscillator, you need to write a class that implements OscillatorImpl.
       The Oscillator class is non-polymorphic and uses the PIMPL idiom to give Oscillators value-like semantics.
@@ -69,11 +122,23 @@ namespace TD_SOUND
       Currently, the only required part of this interface is the call to note.
       It takes the frequency to play and the note time that we are playing at.
       Frequency is in Hertz, time is in seconds.
+
+      If your oscillator repeats itself exactly once every cycle (note(f, t) == note(f, t + 1/f)), override periodic to return true.
+      Then, a CycleCache can sample one cycle of each pitch and play that back instead of calling note for every sample.
+      Noise, or anything with a low-frequency oscillation in it, is not periodic, which is why the default is false.
+
+      With TD_SOUND_FIXED_POINT, periodic oscillators are played through fixedNote, which takes the phase in Q32 and returns Q15.
+      The default calls note for one cycle of a 1 Hz tone, which works, but uses floating point.
+      Oscillators that aren't periodic are always played through note.
     */
    class OscillatorImpl
     {
    public:
       virtual double note(double frequency, double time) const = 0;
+      virtual bool periodic() const;
+#ifdef TD_SOUND_FIXED_POINT
+      virtual int fixedNote(uint32_t phase) const;
+#endif
       virtual ~OscillatorImpl();
     };
 
@@ -86,6 +151,11 @@ namespace TD_SOUND
       Oscillator(const std::shared_ptr<OscillatorImpl>& oscillator);
 
       double note(double frequency, double time) const;
+      bool periodic() const;
+#ifdef TD_SOUND_FIXED_POINT
+      int fixedNote(uint32_t phase) const;
+#endif
+      bool operator< (const Oscillator& rhs) const; // Order by identity of the implementation.
 
       static Oscillator makeSineWaveOscillator();
       static Oscillator makeTriangularWaveOscillator();
@@ -95,11 +165,20 @@ namespace TD_SOUND
       static Oscillator makeRectangularWaveOscillator(double dutyCycle);
     };
 
+   /*
+      With TD_SOUND_FIXED_POINT, fixedLoud is loud in samples rather than seconds, returning Q15.
+      The note hasn't been released if releaseSample is notReleased.
+      The default calls loud, which works, but uses floating point.
+    */
    class EnvelopeImpl
     {
    public:
       virtual double loud(double time, double releaseTime) const = 0;
       virtual double release() const = 0; // Return the release length.
+#ifdef TD_SOUND_FIXED_POINT
+      static const uint32_t notReleased = 0xFFFFFFFFU;
+      virtual int fixedLoud(uint32_t sample, uint32_t releaseSample, uint32_t sampleRate) const;
+#endif
       virtual ~EnvelopeImpl();
     };
 
@@ -113,10 +192,16 @@ namespace TD_SOUND
 
       double loud(double time, double releaseTime) const;
       double release() const;
+#ifdef TD_SOUND_FIXED_POINT
+      int fixedLoud(uint32_t sample, uint32_t releaseSample, uint32_t sampleRate) const;
+#endif
+      bool operator< (const Envelope& rhs) const; // Order by identity of the implementation.
 
       static Envelope makeDefaultAREnvelope();
     };
 
+   class CycleCache;
+
    class Instrument
     {
    private:
@@ -128,6 +213,13 @@ namespace TD_SOUND
 
       double note(double frequency, double time, double releaseTime) const;
       double release() const;
+#ifdef TD_SOUND_FIXED_POINT
+      // Phase is only used by periodic oscillators, and frequency by those that aren't.
+      int fixedNote(double frequency, uint32_t phase, uint32_t sample, uint32_t releaseSample, uint32_t sampleRate) const;
+#endif
+      bool operator< (const Instrument& rhs) const;
+      // Returns this instrument, but playing the given frequency out of the cache, if it can.
+      Instrument tabulate(CycleCache& cache, double frequency) const;
 
       static Instrument makeSineWaveInstrument();
       static Instrument makeTriangularWaveInstrument();
@@ -137,89 +229,502 @@ namespace TD_SOUND
       static Instrument makeRectangularWaveInstrument(double dutyCycle);
     };
 
+   /*
+      CycleCache samples one cycle of a periodic oscillator at a given frequency, and then plays notes of that frequency
+      by interpolating into the table. The oscillator is called tableSize times per pitch, rather than once per sample.
+      Oscillators that aren't periodic are never put in the cache, and neither is anything once the budget is used up.
+    */
+   class CycleCache
+    {
+   private:
+      typedef std::pair<Oscillator, double> Key;
+
+      std::map<Key, Oscillator> tables;
+      std::mutex lock;
+      size_t tableSize;
+      size_t budget;
+      size_t used;
+      const uint64_t id;
+
+   public:
+      CycleCache(size_t maxBytes, size_t tableSize = 2048U);
+      CycleCache(const CycleCache&) = delete;
+      CycleCache& operator=(const CycleCache&) = delete;
+
+      // Returns the oscillator that plays the given frequency from a table, or the original oscillator if it can't.
+      Oscillator find(const Oscillator& oscillator, double frequency);
+      size_t bytesUsed();
+      void clear();
+      // No two caches have the same id, even if one is made where another was destroyed. Zero is no cache.
+      uint64_t getId() const;
+    };
+
+   /*
+      NoteCache remembers what notes sound like, so that a note that is repeated throughout a song is only synthesized once.
+      Because oscillators and envelopes are immutable, a note is completely described by its instrument, frequency, and duration.
+      Every other time the note is played, it is copied out of the cache and scaled by its volume.
+      The cache is sampled at a fixed rate: play it back at a different rate, and you get the nearest sample.
+      The cache will not grow beyond its budget: once it is full, new notes are synthesized live, as if there were no cache.
+    */
+   class NoteCache
+    {
+   private:
+      typedef std::tuple<Instrument, double, double> Key;
+
+      std::map<Key, std::shared_ptr<const std::vector<float> > > renderings;
+      std::mutex lock;
+      double step;
+      size_t budget;
+      size_t used;
+      const uint64_t id;
+
+   public:
+      NoteCache(double sampleRate, size_t maxBytes);
+      NoteCache(const NoteCache&) = delete;
+      NoteCache& operator=(const NoteCache&) = delete;
+
+      // Returns nullptr if the note didn't fit in the cache.
+      std::shared_ptr<const std::vector<float> > find(const Instrument& instrument, double frequency, double duration);
+      double getStep() const;
+      size_t bytesUsed();
+      void clear();
+      uint64_t getId() const; // Like CycleCache::getId.
+    };
+
    class Note
     {
    private:
       Instrument instrument;
+      Instrument original; // Before it was tabulated, so that tabulating again starts from here.
       double frequency;
       double duration;
       double volume;
 
       double startTime;
 
+      std::shared_ptr<const std::vector<float> > rendering;
+      double renderStep;
+
+#ifdef TD_SOUND_FIXED_POINT
+      // The note, in samples, at the sample rate given to fix.
+      uint32_t fixedRate;
+      size_t startSample;
+      uint32_t durationSamples;
+      size_t endSample;
+      uint32_t phaseStart;
+      uint32_t phaseStep;
+      int fixedVolume;
+#endif
+
    public:
       Note(Instrument instrument, double frequency, double startTime, double duration, double volume);
 
       bool before (double time) const;
       bool after (double time) const;
-      double play (double time) const;
+      double end () const; // The time the note has finished its release.
+      template <typename Sample = double> Sample play (double time) const;
+      void memoize (NoteCache& cache);
+      void tabulate (CycleCache& cache);
+#ifdef TD_SOUND_FIXED_POINT
+      void fix (uint32_t sampleRate);
+      bool beforeSample (size_t sample) const;
+      bool afterSample (size_t sample) const;
+      int playFixed (size_t sample) const; // Q15, with volume applied.
+#endif
     };
 
    /*
       Voice assumes that calls to play() will be non-decreasing.
+      A Voice is a cursor into its notes: the notes themselves are shared by every copy of the Voice, and don't change once built.
+      So, copying a Voice is cheap, and copies can be played at the same time on different threads.
+      rehearse (and memoize, tabulate and fix) never change notes that are shared. They make a copy that has been rehearsed,
+      and keep it with the notes, so every copy of the voice that is rehearsed the same way shares that one copy.
+      Rehearsing the same way again only looks it up, and doing what has already been done does nothing.
     */
    class Voice
     {
    private:
-      std::vector<Note> notes;
+      struct Part
+       {
+         std::vector<Note> notes;
+         uint64_t tabulated; // The ids of the caches, or zero.
+         uint64_t memoized;
+         uint32_t fixedRate; // Zero if not fixed. Only the fixed point version fixes notes.
+         double length;
+         // With the notes in order of their start, this makes an interval index: the notes sounding at a time are all
+         // before the first that starts after it, and after the last whose latestEnd is before it.
+         std::vector<double> latestEnd; // The latest end of any note up to and including this one.
+         size_t mostActive; // The most notes that can be active at once, at any sample rate from slowestRate up.
+         std::mutex rehearsing;
+         std::shared_ptr<Part> rehearsal; // The last copy of these notes to be rehearsed. Guarded by rehearsing.
+
+         explicit Part(const std::vector<Note>& notes);
+         Part(const Part& other); // Copies the notes, but not the rehearsal.
+         Part& operator=(const Part&) = delete;
+         void rehearse(CycleCache* cycles, NoteCache* cache, uint32_t sampleRate);
+       };
+
+      std::shared_ptr<Part> part;
       size_t index;
-      std::list<Note*> activeNotes;
+      std::vector<const Note*> activeNotes;
 
-      double endPlay(double time);
+      void adopt(const std::shared_ptr<Part>& notes);
+      template <typename Sample> Sample endPlay(double time);
+#ifdef TD_SOUND_FIXED_POINT
+      int endPlayFixed(size_t sample);
+#endif
 
    public:
+      static constexpr double slowestRate = 8000.0; // Slower than this, and playing may have to make room for more notes.
+
       Voice();
-      Voice(const std::vector<Note> notes);
+      Voice(const std::vector<Note>& notes);
 
       // Get the current sample value, between -1.0 and 1.0, for the given global time.
       // How voices play notes currently constrains making an ADSR envelope:
       //    the release of one note can't overlap with the attack of the next note.
-      double play (double time);
-      double playActive(double time) const;
+      template <typename Sample = double> Sample play (double time);
+      template <typename Sample = double> Sample playActive(double time) const;
+      // Play up to count samples, like Maestro::render. Once finished, the rest of out is silence.
+      template <typename Sample> size_t render(Sample* out, size_t count, size_t firstSample, double step);
+      // Render, without needing (or changing) where the voice is: any range, on any thread, gives the same samples.
+      template <typename Sample> size_t renderRange(Sample* out, size_t count, size_t firstSample, double step) const;
       bool finished() const;
+      double length() const; // The time the last note has finished its release.
       void loop();
+      // Put the voice where it would be after playing time, without playing anything before it: the next play should be later.
+      // This is a binary search, and then a look at the notes that could still be sounding.
+      void seek(double time);
+      // Tabulate the notes with cycles, then memoize them with notes, then fix them at sampleRate. Pass nullptr (or zero)
+      // to leave any of those as they are. In the floating point version, sampleRate is ignored.
+      void rehearse(CycleCache* cycles, NoteCache* notes, uint32_t sampleRate);
+      void memoize(NoteCache& cache);
+      void tabulate(CycleCache& cache);
+      // Make room for as many notes as can play at once, so that playing never allocates (at slowestRate or faster).
+      void reserve();
+#ifdef TD_SOUND_FIXED_POINT
+      void fix(uint32_t sampleRate);
+      bool fixedAt(uint32_t sampleRate) const;
+      int playFixed(size_t sample);
+      // renderRange, with playFixed. The voice must already be fixed.
+      size_t renderRangeFixed(int* out, size_t count, size_t firstSample, double step) const;
+#endif
     };
 
    const std::map<char, Instrument>& getDefaultInstrument();
    Voice buildVoiceFromString(const std::string& input, const std::map<char, Instrument>& instruments = getDefaultInstrument(), const std::vector<double>& pitches = getStandardTwelveToneEqualNotes());
 
+   /*
+      Like a Voice, a Maestro is a cursor: copies share their notes, and their rehearsals. Queueing the same Maestro again
+      doesn't parse or copy any notes, with or without caches: the copy rehearsed the first time is used again.
+    */
    class Maestro
     {
    private:
       std::vector<Voice> choir;
 
    public:
-      Maestro() = default;
+      Maestro();
       Maestro(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments = getDefaultInstrument());
       Maestro(const std::vector<Voice>& choir);
 
-      double play(double time);
+      template <typename Sample = double> Sample play(double time);
+      // Play up to count samples, where the first sample is number firstSample of the song, and each sample is step seconds long.
+      // Stops early if the song finishes, and returns the number of samples played.
+      template <typename Sample> size_t render(Sample* out, size_t count, size_t firstSample, double step);
+      // Render samples firstSample up to firstSample + count, as render would, without needing (or changing) where the song is.
+      // The song isn't changed, so ranges can be rendered on many threads at once, and put together, they are the whole song.
+      template <typename Sample> size_t renderRange(Sample* out, size_t count, size_t firstSample, double step) const;
+      // One voice of renderRange, unmixed (a stem), for voice < voices(). The rest of out is silence.
+      template <typename Sample> size_t renderStem(size_t voice, Sample* out, size_t count, size_t firstSample, double step) const;
+      // Mix one stem for each voice (stems[voice][sample]) into out, exactly as render would have.
+      template <typename Sample> static void mixStems(Sample* out, const Sample* const* stems, size_t voices, size_t count);
+      size_t voices() const;
       bool finished() const;
+      double length() const; // In seconds: the song finishes on the first sample after this.
       void loop();
+      // Put the song where it would be after playing every sample before firstSample: the next render should start at firstSample.
+      // To seek to a time, seek to time / step. Afterwards, the song plays exactly as it would have, without playing what came before.
+      void seek(size_t firstSample, double step);
+      // As Voice::rehearse, for every voice.
+      void rehearse(CycleCache* cycles, NoteCache* notes, uint32_t sampleRate);
+      void memoize(NoteCache& cache);
+      void tabulate(CycleCache& cache);
+      void reserve();
+#ifdef TD_SOUND_FIXED_POINT
+      // Work out where the notes start and end in samples. Rendering does this, but renderRange can't: do it first.
+      void fix(uint32_t sampleRate);
+      bool fixedAt(uint32_t sampleRate) const;
+      // The stems of render<short> are wider than a short: they are only clamped once they are mixed.
+      size_t renderStem(size_t voice, int* out, size_t count, size_t firstSample, double step) const;
+      static void mixStems(short* out, const int* const* stems, size_t voices, size_t count);
+#endif
+    };
+
+#ifdef TD_SOUND_FIXED_POINT
+   // The integer version: renders with saturating 16-bit output. It ignores the note cache.
+   // It fixes the song first, if it needs to. The Venue fixes songs as they are queued, so that its audio thread never does.
+   template <> size_t Maestro::render<short>(short* out, size_t count, size_t firstSample, double step);
+#endif
+
+   /*
+      Worker runs jobs on a thread of its own, in the order they were posted. The thread is started when the Worker is made,
+      so that posting a job never starts a thread. Posting takes a lock for a moment, but never waits for a job to run.
+      Jobs posted after stop aren't run.
+    */
+   class Worker
+    {
+   private:
+      std::thread thread;
+      std::mutex lock;
+      std::condition_variable wakeUp;
+      std::list<std::function<void(void)> > jobs;
+      bool quitting;
+
+      void work();
+
+   public:
+      Worker();
+      ~Worker();
+      Worker(const Worker&) = delete;
+      Worker& operator=(const Worker&) = delete;
+
+      void post(std::function<void(void)> job);
+      void stop(); // Finish every job posted so far, and then stop the thread.
     };
 
+   /*
+      Any thread may queue music or change the queue: those requests are posted to a lock-free stack.
+      The audio thread takes everything posted so far in one atomic exchange when it next needs a sample, and applies it in order.
+      Songs are built by the thread that queues them, and ride along in a list of their own, so that the audio thread can splice
+      them into the program without allocating. The requests (and any songs they cleared out) are handed back to be deleted by
+      the next thread to post a request.
+    */
    class Venue
     {
+   public:
+      enum class MusicEvent { Ended, Cleared }; // The queue ran out of music, or was cleared.
+      enum class CallbackMode
+       {
+         AudioThread, // Call the music callback from the audio thread, as soon as the music ends. The default.
+         Worker,      // Call the music callback from a thread of the Venue's own, soon after.
+         Polled       // Don't call anything: the program calls pollMusicEvent to find out.
+       };
+      enum class StealPolicy { Oldest, Quietest }; // Which effect to stop, when there are too many.
+
    private:
-      std::list<Maestro> program;
-      volatile bool stopPlaying;
-      volatile bool looping;
-      double internalTime;
+      enum class Command { Queue, Clear, Replace, ToggleLoop, Effect, StopEffects, Seek };
+
+      struct Effect
+       {
+         Maestro song;
+         double volume;
+         size_t sample; // The next sample of the effect to play.
+         double level;  // How loud it has been lately, or negative if it hasn't played yet.
+       };
+
+      // A song in the queue, and how far into it we are.
+      struct Performance
+       {
+         Maestro song;
+         std::vector<double> preRoll; // The start of the song, rendered by the thread that queued it.
+         size_t preRolled;            // How much of that can be played: none, if it was rendered at the wrong rate.
+         double preRollStep;
+         size_t sample;               // The next sample of the song to play.
+         std::vector<float> loop;     // The first pass through the song, to play back while looping. Empty if it won't fit.
+         double loopStep;
+         size_t captured;             // How much of the first pass is in loop. It stops counting if a sample is missed.
+         size_t loopLength;           // Once the whole first pass is captured, how long it is.
+       };
+
+      // How to get a song ready to be queued, as of when it is queued.
+      struct Staging
+       {
+         std::shared_ptr<CycleCache> cycles;
+         std::shared_ptr<NoteCache> notes;
+         size_t preRoll;
+         double preRollStep;
+         size_t loopBytes;
+         double loopStep;
+         uint32_t sampleRate; // What the song is fixed at, or zero if the Venue doesn't know yet.
+       };
+
+      struct Cue
+       {
+         Command command;
+         std::list<Performance> songs;
+         std::list<Effect> effects;
+         double time;
+         Cue* next;
+       };
+
+      std::list<Performance> program; // Only the audio thread touches the program.
+      std::atomic<Cue*> cues;     // Posted by anyone, taken by the audio thread.
+      std::atomic<Cue*> retired;  // Handed back by the audio thread, deleted by anyone.
+      Cue* retiring;              // Retired, but not yet handed back.
+      std::list<Performance> finished; // Played out, and waiting for a retired cue to carry them back.
+      std::list<Effect> effects;   // Playing over the music, oldest first.
+      std::list<Effect> finishedEffects;
+      std::atomic<size_t> maxEffects;
+      std::atomic<StealPolicy> stealPolicy;
+      bool looping;
+      std::atomic<size_t> preRollSamples;
+      std::atomic<double> preRollStep;
+      std::atomic<size_t> crossfadeSamples;
+      std::atomic<size_t> loopBytes;
+      std::atomic<double> loopStep;
+      std::atomic<double> playedStep; // The timeDelta the audio thread played at last, or zero if it hasn't yet.
       std::function<void(void)> hollaback;
+      std::atomic<CallbackMode> callbackMode; // Read by the audio thread, so it can be changed while it plays.
+      // Music events, from the audio thread to whoever is listening. When full, events are dropped (and counted) rather than waited on.
+      std::array<MusicEvent, 64U> events;
+      std::atomic<size_t> eventsPosted;
+      std::atomic<size_t> eventsTaken;
+      std::atomic<size_t> eventsDropped;
+      std::thread dispatcher;
+      std::atomic<bool> dispatching;
+      std::shared_ptr<NoteCache> noteCache;
+      std::shared_ptr<CycleCache> cycleCache;
+      Worker builder;
+
+      // The render-ahead ring: the render thread writes it, and the audio thread reads it.
+      // The counts only ever go up, so that the fill is always written - read.
+      // In fixed point, it is rendered by the integer version, so that render-ahead doesn't need an FPU either.
+#ifdef TD_SOUND_FIXED_POINT
+      typedef short RingSample;
+#else
+      typedef double RingSample;
+#endif
+      struct Ring
+       {
+         std::vector<RingSample> samples;
+         std::atomic<size_t> written;
+         std::atomic<size_t> read;
+         std::atomic<size_t> lowestFill;
+         std::atomic<size_t> underruns;
+
+         explicit Ring(size_t capacity);
+         template <typename Sample> void take(Sample* out, size_t count);
+       };
+      std::unique_ptr<Ring> ring;
+      std::thread renderer;
+      std::atomic<bool> renderingAhead;
+
+      static Maestro rehearse(Maestro song, const Staging& staging);
+      Staging getStaging() const;
+      static Performance stage(Maestro song, const Staging& staging);
+      void post(Command command, std::list<Performance>&& songs, std::list<Effect>&& effects = std::list<Effect>(), double time = 0.0);
+      bool takeCues(double timeDelta);
+      void retire(Cue* cue);
+      bool cue(double timeDelta);
+      static void seek(Performance& performance, double time, double timeDelta);
+      static bool over(const Performance& performance);
+      template <typename Sample> static size_t playSong(Performance& performance, Sample* out, size_t count, double timeDelta);
+      size_t fadeStart(const Performance& current, size_t fade, double timeDelta) const;
+      template <typename Sample> size_t crossfade(Sample* out, size_t count, size_t fadeFrom, size_t fade, double timeDelta);
+      void steal();
+      template <typename Sample> void playEffects(Sample* out, size_t count, double timeDelta);
+      void tell(MusicEvent event, double timeDelta);
+      void dispatch();
+      template <typename Sample> void perform(Sample* out, size_t count, double timeDelta);
+      void renderAhead(double timeDelta);
 
+   public:
+      // Each Venue has its own queue, clock, callback, caches and threads, and Venues can play on different threads at the same time.
       Venue();
+      ~Venue();
+      Venue(const Venue&) = delete;
+      Venue& operator=(const Venue&) = delete;
 
-   public:
+      // The Venue that sdGetSample and sfGetSample play.
       static Venue& getInstance();
+      // Delete the songs and requests that the audio thread is done with. The audio thread never deletes anything itself:
+      // everything that posts to the queue calls this first, but a program that rarely changes the queue may want to call it now and then.
+      void reclaim();
       void queueMusic(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments = getDefaultInstrument());
       void queueMusic(const Maestro& song);
+      // Parse the music, and queue it, on a thread of the Venue's own. The audio thread only sees the song once it is built.
+      // Songs queued this way are queued in the order this was called. The future throws std::invalid_argument if the parse failed.
+      // From the music callback on the audio thread, this never waits for the parse, but it isn't free: it copies the music
+      // and the instruments, allocates the job and its future, and takes the worker's lock for a moment to post it.
+      std::future<void> queueMusicAsync(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments = getDefaultInstrument());
+      // Clear the queue and queue this song, with nothing getting in between and no callback for the clear.
+      void replaceQueue(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments = getDefaultInstrument());
+      void replaceQueue(const Maestro& song);
       void clearQueue();
       void toggleLoop();
+      // Jump to this time (in seconds) in the song that is playing, as if it had played up to there.
+      void seek(double time);
+      /*
+         How one song gives way to the next. Songs queued after this call have their first preRoll samples rendered
+         (at timeDelta seconds a sample) by the thread that queues them, so that starting them costs the audio thread nothing.
+         With a crossfade, the next song starts crossfade samples before the one playing ends, and they are mixed with an
+         equal-power crossfade. Pre-roll at least as much as the crossfade, and the crossfade costs no more than playing one song.
+         Either way, one song follows the next to the sample. The default is neither.
+       */
+      void setTransition(size_t preRoll, size_t crossfade, double timeDelta);
+      /*
+         While looping, play the song back from memory after the first pass, rather than synthesizing it again.
+         Every song queued after this call that fits in maxBytes (as float samples at timeDelta seconds a sample) gets a buffer
+         that the first pass is recorded into. Songs that don't fit, or that play at a different rate, are synthesized every time.
+         Pass zero to stop.
+       */
+      void useLoopCache(size_t maxBytes, double timeDelta);
+
+      // Play a sound effect over the music, starting as soon as the audio thread sees it. Effects don't wait in the queue:
+      // any number can play at once, up to the polyphony, and they are mixed on top of the music at the given volume.
+      // Any volume is fine, even one louder than 1: in fixed point, the mix saturates.
+      void playEffect(const Maestro& effect, double volume = 1.0);
+      // Stop every sound effect that is playing.
+      void stopEffects();
+      // When a new effect would make more than maxEffects play at once, stop one, chosen by the policy. The default is 16, oldest first.
+      // Quietest goes by the loudness of the last 50 ms or so: an effect that hasn't played a sample yet is never the quietest.
+      void setEffectPolyphony(size_t maxEffects, StealPolicy policy);
       void addMusicCallback(std::function<void(void)> callOnMusicDone);
-
-      double getSample(int unused, double globalTime, double timeDelta);
+      /*
+         Choose where the music callback is called from. This can be changed while the audio is running, from one thread at a time:
+         the next event goes to the new mode. (The callback itself still has to be added before the audio starts.)
+         In every mode, events come in the order they happened, and each comes after the requests that caused it have been applied:
+         Cleared after the clear, and Ended after the last song was taken off the queue. Music queued in response is queued after
+         anything that was posted before it. Out of the audio thread, that music comes a moment late, so there is a gap between songs.
+         In the Worker and Polled modes, the audio thread only records the event, which never waits or allocates.
+       */
+      void setCallbackMode(CallbackMode mode);
+      // In Polled mode, take the next music event. Returns false if there isn't one. Call it from one thread only.
+      bool pollMusicEvent(MusicEvent& event);
+      // How many events were lost because nobody took them in time.
+      size_t getDroppedMusicEvents() const;
+      // Songs queued after this call will play repeated notes out of the cache. Pass nullptr to stop using it.
+      void useNoteCache(const std::shared_ptr<NoteCache>& cache);
+      // Likewise, but for the oscillators of songs queued after this call.
+      void useCycleCache(const std::shared_ptr<CycleCache>& cache);
+
+      template <typename Sample = double> Sample getSample(int unused, double globalTime, double timeDelta);
+      // The same as count calls to getSample on channel zero, but faster.
+      template <typename Sample> void render(Sample* out, size_t count, double timeDelta);
       static double sdGetSample(int unused, double globalTime, double timeDelta);
       static float sfGetSample(int unused, float globalTime, float timeDelta);
+
+      /*
+         In render-ahead mode, the Venue renders the music on a thread of its own, up to latency samples ahead of the audio thread,
+         and getSample and render just copy out of what it has rendered. This keeps a spike in the work (a big chord, or an
+         expensive instrument) from making the audio thread miss its deadline, at the cost of latency samples of delay on
+         everything that changes the queue. The music callback is called from the render thread, not the audio thread.
+         The timeDelta given here is used for all samples, and the one given to getSample and render is ignored.
+         In fixed point, the ring is rendered as render<short> would, whatever type the samples are taken out as.
+         Like addMusicCallback, start and stop render-ahead while the audio isn't running.
+       */
+      void startRenderAhead(size_t latency, double timeDelta);
+      void stopRenderAhead();
+
+      struct RenderAheadStats
+       {
+         size_t capacity;   // The latency asked for, in samples.
+         size_t fill;       // How many samples are rendered but not played right now.
+         size_t lowestFill; // The least there has been, since the last reset. How close we have come to running out.
+         size_t underruns;  // How many times the audio thread has run out, since the last reset.
+       };
+      RenderAheadStats getRenderAheadStats(bool reset = false);
     };
 
    extern const char * const legalRequirement;
@@ -353,941 +858,3090 @@ namespace TD_SOUND
       return names;
     }
 
-   OscillatorImpl::~OscillatorImpl() { }
-
-   class SineWaveOscillator : public OscillatorImpl
+   template <typename Sample> void scalarAdd (Sample* out, const Sample* in, size_t count)
     {
-   public:
-      double note(double frequency, double time) const override
+      for (size_t i = 0U; i < count; ++i)
        {
-         return sineWave(frequency, time);
+         out[i] += in[i];
        }
-    };
+    }
 
-   class TriangularWaveOscillator : public OscillatorImpl
+   template <typename Sample> void scalarScale (Sample* out, Sample gain, size_t count)
     {
-   public:
-      double note(double frequency, double time) const override
+      for (size_t i = 0U; i < count; ++i)
        {
-         return triangularWave(frequency, time);
+         out[i] *= gain;
        }
-    };
+    }
 
-   class SquareWaveOscillator : public OscillatorImpl
+   template <typename Sample> void scalarToPCM16 (const Sample* in, short* out, size_t count)
     {
-   public:
-      double note(double frequency, double time) const override
+      for (size_t i = 0U; i < count; ++i)
        {
-         return squareWave(frequency, time);
+         out[i] = static_cast<short>(std::clamp(in[i], Sample(-1), Sample(1)) * (std::numeric_limits<short>::max)());
        }
-    };
+    }
 
-   class SawWaveOscillator : public OscillatorImpl
+   static const int PCM24Max = 8388607;
+
+   template <typename Sample> void scalarToPCM24 (const Sample* in, int* out, size_t count)
     {
-   public:
-      double note(double frequency, double time) const override
+      for (size_t i = 0U; i < count; ++i)
        {
-         return sawWave(frequency, time);
+         out[i] = static_cast<int>(std::clamp(in[i], Sample(-1), Sample(1)) * PCM24Max);
        }
-    };
+    }
 
-   class NoiseOscillator : public OscillatorImpl
+   void scalarDoubleToFloat (const double* in, float* out, size_t count)
     {
-   public:
-      double note(double frequency, double time) const override
+      for (size_t i = 0U; i < count; ++i)
        {
-         return noise(frequency, time);
+         out[i] = static_cast<float>(in[i]);
        }
-    };
-
-   class RectangularWaveOscillator : public OscillatorImpl
-    {
-   private:
-      double duty;
+    }
 
-   public:
-      RectangularWaveOscillator(double dutyCycle) : duty(dutyCycle) { }
+#ifdef TD_SOUND_X86_KERNELS
+   // Each of these does as much as it can a vector at a time, and leaves the tail to the scalar version.
 
-      double note(double frequency, double time) const override
+   __attribute__((target("sse2"))) void sse2AddFloat (float* out, const float* in, size_t count)
+    {
+      size_t i = 0U;
+      for (; (i + 4U) <= count; i += 4U)
        {
-         return rectangularWave(frequency, time, duty);
+         _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_loadu_ps(in + i)));
        }
-    };
-
-   Oscillator::Oscillator(const std::shared_ptr<OscillatorImpl>& oscillator) : oscillator(oscillator) { }
+      scalarAdd(out + i, in + i, count - i);
+    }
 
-   double Oscillator::note(double frequency, double time) const
+   __attribute__((target("sse2"))) void sse2AddDouble (double* out, const double* in, size_t count)
     {
-      return oscillator->note(frequency, time);
+      size_t i = 0U;
+      for (; (i + 2U) <= count; i += 2U)
+       {
+         _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(out + i), _mm_loadu_pd(in + i)));
+       }
+      scalarAdd(out + i, in + i, count - i);
     }
 
-   Oscillator Oscillator::makeSineWaveOscillator()
+   __attribute__((target("sse2"))) void sse2ScaleFloat (float* out, float gain, size_t count)
     {
-      static std::shared_ptr<OscillatorImpl> theSineWaveGenerator = std::make_shared<SineWaveOscillator>();
-      return Oscillator(theSineWaveGenerator);
+      size_t i = 0U;
+      __m128 g = _mm_set1_ps(gain);
+      for (; (i + 4U) <= count; i += 4U)
+       {
+         _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(out + i), g));
+       }
+      scalarScale(out + i, gain, count - i);
     }
 
-   Oscillator Oscillator::makeTriangularWaveOscillator()
+   __attribute__((target("sse2"))) void sse2ScaleDouble (double* out, double gain, size_t count)
     {
-      static std::shared_ptr<OscillatorImpl> theTriangularWaveGenerator = std::make_shared<TriangularWaveOscillator>();
-      return Oscillator(theTriangularWaveGenerator);
+      size_t i = 0U;
+      __m128d g = _mm_set1_pd(gain);
+      for (; (i + 2U) <= count; i += 2U)
+       {
+         _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(out + i), g));
+       }
+      scalarScale(out + i, gain, count - i);
     }
 
-   Oscillator Oscillator::makeSquareWaveOscillator()
+   __attribute__((target("sse2"))) void sse2FloatToPCM16 (const float* in, short* out, size_t count)
     {
-      static std::shared_ptr<OscillatorImpl> theSquareWaveGenerator = std::make_shared<SquareWaveOscillator>();
-      return Oscillator(theSquareWaveGenerator);
+      size_t i = 0U;
+      __m128 low = _mm_set1_ps(-1.0f), high = _mm_set1_ps(1.0f), scale = _mm_set1_ps(32767.0f);
+      for (; (i + 8U) <= count; i += 8U)
+       {
+         __m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), low), high), scale));
+         __m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4U), low), high), scale));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(a, b));
+       }
+      scalarToPCM16(in + i, out + i, count - i);
     }
 
-   Oscillator Oscillator::makeSawWaveOscillator()
+   __attribute__((target("sse2"))) void sse2DoubleToPCM16 (const double* in, short* out, size_t count)
     {
-      static std::shared_ptr<OscillatorImpl> theSawWaveGenerator = std::make_shared<SawWaveOscillator>();
-      return Oscillator(theSawWaveGenerator);
+      size_t i = 0U;
+      __m128d low = _mm_set1_pd(-1.0), high = _mm_set1_pd(1.0), scale = _mm_set1_pd(32767.0);
+      for (; (i + 4U) <= count; i += 4U)
+       {
+         __m128i a = _mm_cvttpd_epi32(_mm_mul_pd(_mm_min_pd(_mm_max_pd(_mm_loadu_pd(in + i), low), high), scale));
+         __m128i b = _mm_cvttpd_epi32(_mm_mul_pd(_mm_min_pd(_mm_max_pd(_mm_loadu_pd(in + i + 2U), low), high), scale));
+         _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(_mm_unpacklo_epi64(a, b), a));
+       }
+      scalarToPCM16(in + i, out + i, count - i);
     }
 
-   Oscillator Oscillator::makeNoiseOscillator()
+   __attribute__((target("sse2"))) void sse2FloatToPCM24 (const float* in, int* out, size_t count)
     {
-      static std::shared_ptr<OscillatorImpl> theNoiseGenerator = std::make_shared<NoiseOscillator>();
-      return Oscillator(theNoiseGenerator);
+      size_t i = 0U;
+      __m128 low = _mm_set1_ps(-1.0f), high = _mm_set1_ps(1.0f), scale = _mm_set1_ps(8388607.0f);
+      for (; (i + 4U) <= count; i += 4U)
+       {
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), low), high), scale)));
+       }
+      scalarToPCM24(in + i, out + i, count - i);
     }
 
-   Oscillator Oscillator::makeRectangularWaveOscillator(double dutyCycle)
+   __attribute__((target("sse2"))) void sse2DoubleToPCM24 (const double* in, int* out, size_t count)
     {
-      return Oscillator(std::make_shared<RectangularWaveOscillator>(dutyCycle));
+      size_t i = 0U;
+      __m128d low = _mm_set1_pd(-1.0), high = _mm_set1_pd(1.0), scale = _mm_set1_pd(8388607.0);
+      for (; (i + 4U) <= count; i += 4U)
+       {
+         __m128i a = _mm_cvttpd_epi32(_mm_mul_pd(_mm_min_pd(_mm_max_pd(_mm_loadu_pd(in + i), low), high), scale));
+         __m128i b = _mm_cvttpd_epi32(_mm_mul_pd(_mm_min_pd(_mm_max_pd(_mm_loadu_pd(in + i + 2U), low), high), scale));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi64(a, b));
+       }
+      scalarToPCM24(in + i, out + i, count - i);
     }
 
-   EnvelopeImpl::~EnvelopeImpl() { }
-
-   class AREnvelope : public EnvelopeImpl
+   __attribute__((target("sse2"))) void sse2DoubleToFloat (const double* in, float* out, size_t count)
     {
-   private:
-      double attackPeak;
-      double attackLength;
-      double releaseLength;
-
-   public:
-      AREnvelope() : attackPeak(1.0), attackLength(240.0 / (64 * 256) * 0.1), releaseLength(240.0 / (64 * 256) * 0.1) { }
-
-      double loud(double time, double releaseTime) const override
+      size_t i = 0U;
+      for (; (i + 4U) <= count; i += 4U)
        {
-         double result = 0.0;
-         if (-1.0 == releaseTime) //The note hasn't been released yet.
-          {
-            if (time < attackLength)
-             {
-               result = (time / attackLength) * attackPeak;
-             }
-            else
-             {
-               result = attackPeak;
-             }
-          }
-         else
-          {
-            if (releaseTime < attackLength)
-             {
-               result = (time / attackLength) * attackPeak;
-             }
-            else
-             {
-               result = attackPeak;
-             }
-            result = result * ((releaseTime + releaseLength - time) / releaseLength);
-          }
-         return result;
+         _mm_storeu_ps(out + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(in + i)), _mm_cvtpd_ps(_mm_loadu_pd(in + i + 2U))));
        }
+      scalarDoubleToFloat(in + i, out + i, count - i);
+    }
 
-      double release() const override
+   __attribute__((target("avx2"))) void avx2AddFloat (float* out, const float* in, size_t count)
+    {
+      size_t i = 0U;
+      for (; (i + 8U) <= count; i += 8U)
        {
-         return releaseLength;
+         _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_loadu_ps(in + i)));
        }
-    };
-
-   Envelope::Envelope(const std::shared_ptr<EnvelopeImpl>& envelope) : envelope(envelope) { }
+      scalarAdd(out + i, in + i, count - i);
+    }
 
-   double Envelope::loud(double time, double releaseTime) const
+   __attribute__((target("avx2"))) void avx2AddDouble (double* out, const double* in, size_t count)
     {
-      return envelope->loud(time, releaseTime);
+      size_t i = 0U;
+      for (; (i + 4U) <= count; i += 4U)
+       {
+         _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(out + i), _mm256_loadu_pd(in + i)));
+       }
+      scalarAdd(out + i, in + i, count - i);
     }
 
-   double Envelope::release() const
+   __attribute__((target("avx2"))) void avx2ScaleFloat (float* out, float gain, size_t count)
     {
-      return envelope->release();
+      size_t i = 0U;
+      __m256 g = _mm256_set1_ps(gain);
+      for (; (i + 8U) <= count; i += 8U)
+       {
+         _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(out + i), g));
+       }
+      scalarScale(out + i, gain, count - i);
     }
 
-   Envelope Envelope::makeDefaultAREnvelope()
+   __attribute__((target("avx2"))) void avx2ScaleDouble (double* out, double gain, size_t count)
     {
-      static std::shared_ptr<EnvelopeImpl> defaultAR = std::make_shared<AREnvelope>();
-      return Envelope(defaultAR);
+      size_t i = 0U;
+      __m256d g = _mm256_set1_pd(gain);
+      for (; (i + 4U) <= count; i += 4U)
+       {
+         _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(out + i), g));
+       }
+      scalarScale(out + i, gain, count - i);
     }
 
-   Instrument::Instrument(Oscillator oscillator, Envelope envelope) : oscillator(oscillator), envelope(envelope) { }
-
-   double Instrument::note(double frequency, double time, double releaseTime) const
+   __attribute__((target("avx2"))) void avx2FloatToPCM16 (const float* in, short* out, size_t count)
     {
-      return envelope.loud(time, releaseTime) * oscillator.note(frequency, time);
+      size_t i = 0U;
+      __m256 low = _mm256_set1_ps(-1.0f), high = _mm256_set1_ps(1.0f), scale = _mm256_set1_ps(32767.0f);
+      for (; (i + 16U) <= count; i += 16U)
+       {
+         __m256i a = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i), low), high), scale));
+         __m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i + 8U), low), high), scale));
+         // The pack works within each 128-bit lane, so put the lanes back in order.
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8));
+       }
+      scalarToPCM16(in + i, out + i, count - i);
     }
 
-   double Instrument::release() const
+   __attribute__((target("avx2"))) void avx2DoubleToPCM16 (const double* in, short* out, size_t count)
     {
-      return envelope.release();
+      size_t i = 0U;
+      __m256d low = _mm256_set1_pd(-1.0), high = _mm256_set1_pd(1.0), scale = _mm256_set1_pd(32767.0);
+      for (; (i + 8U) <= count; i += 8U)
+       {
+         __m128i a = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(in + i), low), high), scale));
+         __m128i b = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(in + i + 4U), low), high), scale));
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(a, b));
+       }
+      scalarToPCM16(in + i, out + i, count - i);
     }
 
-   Instrument Instrument::makeSineWaveInstrument()
+   __attribute__((target("avx2"))) void avx2FloatToPCM24 (const float* in, int* out, size_t count)
     {
-      return Instrument(Oscillator::makeSineWaveOscillator(), Envelope::makeDefaultAREnvelope());
+      size_t i = 0U;
+      __m256 low = _mm256_set1_ps(-1.0f), high = _mm256_set1_ps(1.0f), scale = _mm256_set1_ps(8388607.0f);
+      for (; (i + 8U) <= count; i += 8U)
+       {
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i), low), high), scale)));
+       }
+      scalarToPCM24(in + i, out + i, count - i);
     }
 
-   Instrument Instrument::makeTriangularWaveInstrument()
+   __attribute__((target("avx2"))) void avx2DoubleToPCM24 (const double* in, int* out, size_t count)
     {
-      return Instrument(Oscillator::makeTriangularWaveOscillator(), Envelope::makeDefaultAREnvelope());
+      size_t i = 0U;
+      __m256d low = _mm256_set1_pd(-1.0), high = _mm256_set1_pd(1.0), scale = _mm256_set1_pd(8388607.0);
+      for (; (i + 4U) <= count; i += 4U)
+       {
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(in + i), low), high), scale)));
+       }
+      scalarToPCM24(in + i, out + i, count - i);
     }
 
-   Instrument Instrument::makeSquareWaveInstrument()
+   __attribute__((target("avx2"))) void avx2DoubleToFloat (const double* in, float* out, size_t count)
     {
-      return Instrument(Oscillator::makeSquareWaveOscillator(), Envelope::makeDefaultAREnvelope());
+      size_t i = 0U;
+      for (; (i + 4U) <= count; i += 4U)
+       {
+         _mm_storeu_ps(out + i, _mm256_cvtpd_ps(_mm256_loadu_pd(in + i)));
+       }
+      scalarDoubleToFloat(in + i, out + i, count - i);
     }
 
-   Instrument Instrument::makeSawWaveInstrument()
+   // GCC 12 warns about the unused pass-through argument inside its own AVX-512 intrinsics.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+   __attribute__((target("avx512f"))) void avx512AddFloat (float* out, const float* in, size_t count)
     {
-      return Instrument(Oscillator::makeSawWaveOscillator(), Envelope::makeDefaultAREnvelope());
+      size_t i = 0U;
+      for (; (i + 16U) <= count; i += 16U)
+       {
+         _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(out + i), _mm512_loadu_ps(in + i)));
+       }
+      scalarAdd(out + i, in + i, count - i);
     }
 
-   Instrument Instrument::makeNoiseInstrument()
+   __attribute__((target("avx512f"))) void avx512AddDouble (double* out, const double* in, size_t count)
     {
-      return Instrument(Oscillator::makeNoiseOscillator(), Envelope::makeDefaultAREnvelope());
+      size_t i = 0U;
+      for (; (i + 8U) <= count; i += 8U)
+       {
+         _mm512_storeu_pd(out + i, _mm512_add_pd(_mm512_loadu_pd(out + i), _mm512_loadu_pd(in + i)));
+       }
+      scalarAdd(out + i, in + i, count - i);
     }
 
-   Instrument Instrument::makeRectangularWaveInstrument(double dutyCycle)
+   __attribute__((target("avx512f"))) void avx512ScaleFloat (float* out, float gain, size_t count)
     {
-      return Instrument(Oscillator::makeRectangularWaveOscillator(dutyCycle), Envelope::makeDefaultAREnvelope());
+      size_t i = 0U;
+      __m512 g = _mm512_set1_ps(gain);
+      for (; (i + 16U) <= count; i += 16U)
+       {
+         _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_loadu_ps(out + i), g));
+       }
+      scalarScale(out + i, gain, count - i);
     }
 
-   Note::Note(Instrument instrument, double frequency, double startTime, double duration, double volume) :
-      instrument(instrument), frequency(frequency), duration(duration), volume(volume), startTime(startTime) { }
-
-   bool Note::before (double time) const
+   __attribute__((target("avx512f"))) void avx512ScaleDouble (double* out, double gain, size_t count)
     {
-      return time < startTime;
+      size_t i = 0U;
+      __m512d g = _mm512_set1_pd(gain);
+      for (; (i + 8U) <= count; i += 8U)
+       {
+         _mm512_storeu_pd(out + i, _mm512_mul_pd(_mm512_loadu_pd(out + i), g));
+       }
+      scalarScale(out + i, gain, count - i);
     }
 
-   bool Note::after (double time) const
+   __attribute__((target("avx512f"))) void avx512FloatToPCM16 (const float* in, short* out, size_t count)
     {
-      return time > (startTime + duration + instrument.release());
+      size_t i = 0U;
+      __m512 low = _mm512_set1_ps(-1.0f), high = _mm512_set1_ps(1.0f), scale = _mm512_set1_ps(32767.0f);
+      for (; (i + 16U) <= count; i += 16U)
+       {
+         __m512i a = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_min_ps(_mm512_max_ps(_mm512_loadu_ps(in + i), low), high), scale));
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvtsepi32_epi16(a));
+       }
+      scalarToPCM16(in + i, out + i, count - i);
     }
 
-   double Note::play (double time) const
+   __attribute__((target("avx512f"))) void avx512DoubleToPCM16 (const double* in, short* out, size_t count)
     {
-      double noteTime = time - startTime;
-      return volume * instrument.note(frequency, noteTime, ((noteTime < duration) ? -1.0 : duration));
+      size_t i = 0U;
+      __m512d low = _mm512_set1_pd(-1.0), high = _mm512_set1_pd(1.0), scale = _mm512_set1_pd(32767.0);
+      for (; (i + 16U) <= count; i += 16U)
+       {
+         __m256i a = _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_min_pd(_mm512_max_pd(_mm512_loadu_pd(in + i), low), high), scale));
+         __m256i b = _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_min_pd(_mm512_max_pd(_mm512_loadu_pd(in + i + 8U), low), high), scale));
+         __m512i both = _mm512_inserti64x4(_mm512_castsi256_si512(a), b, 1);
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvtsepi32_epi16(both));
+       }
+      scalarToPCM16(in + i, out + i, count - i);
     }
 
-   Voice::Voice() : notes(), index(0U), activeNotes() { }
-   Voice::Voice(const std::vector<Note> notes) : notes(notes), index(0U), activeNotes() { }
-
-   double Voice::endPlay(double time)
+   __attribute__((target("avx512f"))) void avx512FloatToPCM24 (const float* in, int* out, size_t count)
     {
-      double result = playActive(time);
-      activeNotes.remove_if([=](const Note* note) { return note->after(time); });
-      return result;
+      size_t i = 0U;
+      __m512 low = _mm512_set1_ps(-1.0f), high = _mm512_set1_ps(1.0f), scale = _mm512_set1_ps(8388607.0f);
+      for (; (i + 16U) <= count; i += 16U)
+       {
+         _mm512_storeu_si512(out + i, _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_min_ps(_mm512_max_ps(_mm512_loadu_ps(in + i), low), high), scale)));
+       }
+      scalarToPCM24(in + i, out + i, count - i);
     }
 
-   double Voice::play (double time)
+   __attribute__((target("avx512f"))) void avx512DoubleToPCM24 (const double* in, int* out, size_t count)
     {
-      // Skip all passed notes.
-      while ((index < notes.size()) && (true == notes[index].after(time)))
+      size_t i = 0U;
+      __m512d low = _mm512_set1_pd(-1.0), high = _mm512_set1_pd(1.0), scale = _mm512_set1_pd(8388607.0);
+      for (; (i + 8U) <= count; i += 8U)
        {
-         ++index;
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_min_pd(_mm512_max_pd(_mm512_loadu_pd(in + i), low), high), scale)));
        }
-      // Exit if we are done.
-      if (index == notes.size())
+      scalarToPCM24(in + i, out + i, count - i);
+    }
+
+   __attribute__((target("avx512f"))) void avx512DoubleToFloat (const double* in, float* out, size_t count)
+    {
+      size_t i = 0U;
+      for (; (i + 8U) <= count; i += 8U)
        {
-         return endPlay(time);
+         _mm256_storeu_ps(out + i, _mm512_cvtpd_ps(_mm512_loadu_pd(in + i)));
        }
-      // If this note hasn't started, we are resting.
-      if ((index < notes.size()) && (true == notes[index].before(time)))
+      scalarDoubleToFloat(in + i, out + i, count - i);
+    }
+
+#pragma GCC diagnostic pop
+#endif /* TD_SOUND_X86_KERNELS */
+
+   // Best first.
+   const std::vector<Kernels>& getAllKernels()
+    {
+      static const std::vector<Kernels> kernels = []()
        {
-         return endPlay(time);
-       }
-      // We must be playing this note right now.
-      while ((index < notes.size()) && (false == notes[index].before(time)))
+         std::vector<Kernels> result;
+#ifdef TD_SOUND_X86_KERNELS
+         __builtin_cpu_init();
+         if (0 != __builtin_cpu_supports("avx512f"))
+          {
+            result.push_back(Kernels { "avx512", avx512AddFloat, avx512AddDouble, avx512ScaleFloat, avx512ScaleDouble, avx512FloatToPCM16, avx512DoubleToPCM16,
+               avx512FloatToPCM24, avx512DoubleToPCM24, avx512DoubleToFloat });
+          }
+         if (0 != __builtin_cpu_supports("avx2"))
+          {
+            result.push_back(Kernels { "avx2", avx2AddFloat, avx2AddDouble, avx2ScaleFloat, avx2ScaleDouble, avx2FloatToPCM16, avx2DoubleToPCM16,
+               avx2FloatToPCM24, avx2DoubleToPCM24, avx2DoubleToFloat });
+          }
+         if (0 != __builtin_cpu_supports("sse2"))
+          {
+            result.push_back(Kernels { "sse2", sse2AddFloat, sse2AddDouble, sse2ScaleFloat, sse2ScaleDouble, sse2FloatToPCM16, sse2DoubleToPCM16,
+               sse2FloatToPCM24, sse2DoubleToPCM24, sse2DoubleToFloat });
+          }
+#endif
+         result.push_back(Kernels { "scalar", scalarAdd<float>, scalarAdd<double>, scalarScale<float>, scalarScale<double>, scalarToPCM16<float>, scalarToPCM16<double>,
+            scalarToPCM24<float>, scalarToPCM24<double>, scalarDoubleToFloat });
+         return result;
+       }();
+      return kernels;
+    }
+
+   std::atomic<const Kernels*>& getChosenKernels()
+    {
+      static std::atomic<const Kernels*> chosen (&getAllKernels().front());
+      return chosen;
+    }
+
+   const Kernels& getKernels()
+    {
+      return *getChosenKernels().load(std::memory_order_acquire);
+    }
+
+   std::vector<std::string> getAvailableKernels()
+    {
+      std::vector<std::string> result;
+      for (const auto& kernels : getAllKernels())
        {
-         activeNotes.push_back(&(notes[index]));
-         ++index;
+         result.emplace_back(kernels.name);
        }
-      return endPlay(time);
+      return result;
     }
 
-   double Voice::playActive(double time) const
+   bool useKernels(const std::string& name)
     {
-      double sum = 0.0;
-      for (const Note * note : activeNotes)
+      for (const auto& kernels : getAllKernels())
        {
-         sum += note->play(time);
+         if (name == kernels.name)
+          {
+            getChosenKernels().store(&kernels, std::memory_order_release);
+            return true;
+          }
        }
-      return sum;
+      return false;
     }
 
-   bool Voice::finished() const
+   // Let the templates pick the right kernel.
+   void addSamples (float* out, const float* in, size_t count)
     {
-      return (index == notes.size() && (0U == activeNotes.size()));
+      getKernels().addFloat(out, in, count);
     }
 
-   void Voice::loop()
+   void addSamples (double* out, const double* in, size_t count)
     {
-      index = 0U;
-      activeNotes.clear();
+      getKernels().addDouble(out, in, count);
     }
 
-   std::map<char, Instrument> makeDefaultInstrument()
+   void scaleSamples (float* out, float gain, size_t count)
     {
-      std::map<char, Instrument> result;
-      result.insert(std::make_pair('\0', Instrument::makeSquareWaveInstrument()));
-      return result;
+      getKernels().scaleFloat(out, gain, count);
     }
 
-   const std::map<char, Instrument>& getDefaultInstrument()
+   void scaleSamples (double* out, double gain, size_t count)
     {
-      static const std::map<char, Instrument> instruments = makeDefaultInstrument();
-      return instruments;
+      getKernels().scaleDouble(out, gain, count);
     }
 
-   class StringProcessor
+   bool OscillatorImpl::periodic() const
     {
-   public:
-      const std::string& input;
-      size_t location;
-      char peeked;
+      return false;
+    }
 
-      StringProcessor(const std::string& input) : input(input), location(0U), peeked('\0')
+#ifdef TD_SOUND_FIXED_POINT
+   static const int Q15One = 32767;
+   static const double Q32Cycle = 4294967296.0;
+
+   int OscillatorImpl::fixedNote(uint32_t phase) const
+    {
+      return static_cast<int>(note(1.0, phase / Q32Cycle) * Q15One);
+    }
+
+   // Quarter-wave sine table with one extra entry, so that interpolation never has to wrap.
+   static const int sineTableBits = 10;
+
+   const std::vector<int>& getFixedSineTable()
+    {
+      static const std::vector<int> table = []()
        {
-         if (0U != input.length())
+         std::vector<int> result ((1 << sineTableBits) + 1, 0);
+         for (size_t i = 0U; i < result.size(); ++i)
           {
-            peeked = std::toupper(static_cast<unsigned char>(input[0]));
-            // std::isspace doesn't return true, it returns not false
-            if (false != std::isspace(static_cast<unsigned char>(peeked)))
-             {
-               peeked = getNextChar();
-             }
+            result[i] = static_cast<int>(std::lround(std::sin(M_PI_2 * i / (1 << sineTableBits)) * Q15One));
           }
+         return result;
+       }();
+      return table;
+    }
+
+   int fixedSineWave (uint32_t phase)
+    {
+      const std::vector<int>& table = getFixedSineTable();
+      uint32_t quadrant = phase >> 30;
+      uint32_t within = phase & 0x3FFFFFFFU;
+      if (0U != (quadrant & 1U)) // Falling quarters read the table backwards.
+       {
+         within = 0x40000000U - within;
+       }
+      uint32_t index = within >> (30 - sineTableBits);
+      int fraction = static_cast<int>((within >> (30 - sineTableBits - 15)) & 0x7FFFU);
+      int result = table[index];
+      if (index < (1U << sineTableBits))
+       {
+         result += ((table[index + 1U] - result) * fraction) >> 15;
        }
+      return (quadrant < 2U) ? result : -result;
+    }
 
-      bool done () const
+   int fixedTriangularWave (uint32_t phase)
+    {
+      // Shift by a quarter cycle, then the wave is one minus four times the distance from the half cycle.
+      uint32_t shifted = phase + 0x40000000U;
+      uint32_t distance = (shifted >= 0x80000000U) ? (shifted - 0x80000000U) : (0x80000000U - shifted);
+      return std::min(32768 - static_cast<int>(distance >> 15), Q15One);
+    }
+
+   int fixedSquareWave (uint32_t phase)
+    {
+      return (phase < 0x80000000U) ? Q15One : -Q15One;
+    }
+
+   int fixedSawWave (uint32_t phase)
+    {
+      return static_cast<int32_t>(phase) >> 16;
+    }
+
+   int fixedRectangularWave (uint32_t phase, uint32_t duty)
+    {
+      return (phase <= duty) ? Q15One : -Q15One;
+    }
+#endif /* TD_SOUND_FIXED_POINT */
+
+   OscillatorImpl::~OscillatorImpl() { }
+
+   class SineWaveOscillator : public OscillatorImpl
+    {
+   public:
+      double note(double frequency, double time) const override
        {
-         return location == input.length();
+         return sineWave(frequency, time);
        }
 
-      char getNextChar()
+      bool periodic() const override
        {
-         bool gotNext = false;
-         char result = '\0';
-         while (false == gotNext)
-          {
-            ++location;
-            if (location == input.length())
-             {
-               gotNext = true;
-             }
-            else if (false == std::isspace(static_cast<unsigned char>(input[location])))
-             {
-               gotNext = true;
-               result = std::toupper(static_cast<unsigned char>(input[location]));
-             }
-          }
-         return result;
+         return true;
        }
 
-      char peek () const
+#ifdef TD_SOUND_FIXED_POINT
+      int fixedNote(uint32_t phase) const override
        {
-         return peeked;
+         return fixedSineWave(phase);
        }
+#endif
+    };
 
-      char consume ()
+   class TriangularWaveOscillator : public OscillatorImpl
+    {
+   public:
+      double note(double frequency, double time) const override
        {
-         char result = peeked;
-         peeked = getNextChar();
-         return result;
+         return triangularWave(frequency, time);
        }
 
-      int getNumber ()
+      bool periodic() const override
        {
-         int number = 0;
-         bool firstChar = true;
-         bool keepLooking = true;
-         while (true == keepLooking)
-          {
-            switch (peek())
-             {
-               case '0':
-               case '1':
-               case '2':
-               case '3':
-               case '4':
-               case '5':
-               case '6':
-               case '7':
-               case '8':
-               case '9':
-                  number = number * 10 + (consume() - '0');
-                  break;
-               default:
-                  if (true == firstChar)
-                   {
-                     throw std::invalid_argument("Command requires value, none given.");
-                   }
-                  keepLooking = false;
-                  break;
-             }
-            firstChar = false;
-          }
-         return number;
+         return true;
+       }
+
+#ifdef TD_SOUND_FIXED_POINT
+      int fixedNote(uint32_t phase) const override
+       {
+         return fixedTriangularWave(phase);
        }
+#endif
     };
 
-   Voice buildVoiceFromString(const std::string& input, const std::map<char, Instrument>& instruments, const std::vector<double>& inPitches)
+   class SquareWaveOscillator : public OscillatorImpl
     {
-      static const int map [] = { 9, 11, 0, 2, 4, 5, 7 };
+   public:
+      double note(double frequency, double time) const override
+       {
+         return squareWave(frequency, time);
+       }
 
-      int currentOctave = 4;
-      int currentBeatNote = 4;
-      int currentTempo = 120;
-      double articulation = 7.0 / 8.0;
-      // Length in seconds of each note. There are 60 seconds in a minute, but tempo is in quarter notes per minute.
-      //          sec / 4minute      beats / note      note / 4minute
-      double noteLength = 240.0 / (currentBeatNote * currentTempo);
-      double volume = 0.5;
-      double time = 0.0;
+      bool periodic() const override
+       {
+         return true;
+       }
 
-      std::vector<Note> notes;
+#ifdef TD_SOUND_FIXED_POINT
+      int fixedNote(uint32_t phase) const override
+       {
+         return fixedSquareWave(phase);
+       }
+#endif
+    };
 
-      if (totalNotes != static_cast<int>(inPitches.size()))
+   class SawWaveOscillator : public OscillatorImpl
+    {
+   public:
+      double note(double frequency, double time) const override
        {
-         throw std::invalid_argument("Note array of invalid size.");
+         return sawWave(frequency, time);
        }
-      std::vector<double> pitches = inPitches;
 
-      if (instruments.find('\0') == instruments.end())
+      bool periodic() const override
        {
-         throw std::invalid_argument("No default instrument in instrument list.");
+         return true;
        }
-      Instrument instrument = instruments.find('\0')->second;
 
-      StringProcessor command (input);
+#ifdef TD_SOUND_FIXED_POINT
+      int fixedNote(uint32_t phase) const override
+       {
+         return fixedSawWave(phase);
+       }
+#endif
+    };
 
-      while (false == command.done())
+   class NoiseOscillator : public OscillatorImpl
+    {
+   public:
+      double note(double frequency, double time) const override
        {
-         switch (command.peek())
-          {
-         case 'A':
-         case 'B':
-         case 'C':
-         case 'D':
-         case 'E':
-         case 'F':
-         case 'G':
+         return noise(frequency, time);
+       }
+    };
+
+   class RectangularWaveOscillator : public OscillatorImpl
+    {
+   private:
+      double duty;
+#ifdef TD_SOUND_FIXED_POINT
+      uint32_t fixedDuty = 0U;
+#endif
+
+   public:
+      RectangularWaveOscillator(double dutyCycle) : duty(dutyCycle)
+       {
+#ifdef TD_SOUND_FIXED_POINT
+         fixedDuty = static_cast<uint32_t>(std::min(duty * Q32Cycle, Q32Cycle - 1.0));
+#endif
+       }
+
+      double note(double frequency, double time) const override
+       {
+         return rectangularWave(frequency, time, duty);
+       }
+
+      bool periodic() const override
+       {
+         return true;
+       }
+
+#ifdef TD_SOUND_FIXED_POINT
+      int fixedNote(uint32_t phase) const override
+       {
+         return fixedRectangularWave(phase, fixedDuty);
+       }
+#endif
+    };
+
+   class CycleTableOscillator : public OscillatorImpl
+    {
+   private:
+      Oscillator source;
+      double tableFrequency;
+      std::vector<float> table;
+
+   public:
+      CycleTableOscillator(const Oscillator& source, double frequency, size_t tableSize) : source(source), tableFrequency(frequency), table(tableSize, 0.0f)
+       {
+         for (size_t i = 0U; i < tableSize; ++i)
           {
-            int in = map[command.consume() - 'A'];
-            int note = currentOctave * notesPerOctave + in;
+            table[i] = static_cast<float>(source.note(frequency, i / (tableSize * frequency)));
+          }
+       }
 
-            double tempDuration = articulation;
-            double tempLength = noteLength;
-            double tempVolume = volume;
+      double note(double frequency, double time) const override
+       {
+         if (frequency != tableFrequency) // This table is no good for this note.
+          {
+            return source.note(frequency, time);
+          }
+         double cycle = frequency * time;
+         double location = (cycle - std::floor(cycle)) * table.size();
+         size_t sample = static_cast<size_t>(location);
+         double fraction = location - sample;
+         sample = std::min(sample, table.size() - 1U);
+         size_t next = (sample + 1U == table.size()) ? 0U : (sample + 1U);
+         return table[sample] + fraction * (table[next] - table[sample]);
+       }
 
-            bool modifiers = true;
-            bool advance = true;
-            double nextDot = tempLength * 0.5;
-            while (true == modifiers)
-             {
-               switch (command.peek())
-                {
-               case '+':
-               case '#':
-                  command.consume();
-                  ++note;
-                  if (totalNotes == note)
-                   {
-                     throw std::invalid_argument("Tried to sharp the highest note.");
-                   }
-                  break;
-               case '-':
-                  command.consume();
-                  --note;
-                  if (-1 == note)
-                   {
-                     throw std::invalid_argument("Tried to flat the lowest note.");
-                   }
-                  break;
-               case '.':
-                  command.consume();
-                  tempLength += nextDot;
-                  nextDot *= 0.5;
-                  break;
-               case '1': // This modifier/suffix overrides the length of the note.
-               case '2': // It MUST occur before a '.'.
-               case '3':
-               case '4':
-               case '5':
-               case '6':
-               case '7':
-               case '8':
-               case '9':
-                {
-                  int length = command.getNumber();
-                  if ((length < 1) || (length > 64))
-                   {
-                     throw std::invalid_argument("Invalid note length.");
-                   }
-                  tempLength = 240.0 / (length * currentTempo);
-                  nextDot = tempLength * 0.5;
-                }
-                  break;
-               case '_':
-                  command.consume();
-                  tempDuration = 1.0;
-                  break;
-               case '\'':
-                  command.consume();
-                  tempDuration = 3.0 / 4.0;
-                  break;
-               case '^':
-                  command.consume();
-                  tempVolume = std::min(tempVolume + 0.125, 1.0);
-                  break;
-               case ',':
-                  command.consume();
-                  modifiers = false;
-                  advance = false;
-                  break;
-               default:
-                  modifiers = false;
-                  break;
-                }
-             }
+      bool periodic() const override
+       {
+         return true;
+       }
+    };
 
-            notes.emplace_back(instrument, pitches[note], time, tempLength * tempDuration, tempVolume);
-            if (true == advance)
-             {
-               time += tempLength;
-             }
-          }
-            break;
+   Oscillator::Oscillator(const std::shared_ptr<OscillatorImpl>& oscillator) : oscillator(oscillator) { }
 
-         case '>':
-            command.consume();
-            ++currentOctave;
-            if (octavesImplemented == currentOctave)
-             {
-               throw std::invalid_argument("Operation '>' exceeded octave range.");
-             }
-            break;
+   double Oscillator::note(double frequency, double time) const
+    {
+      return oscillator->note(frequency, time);
+    }
 
-         case '<':
-            command.consume();
-            --currentOctave;
-            if (-1 == currentOctave)
-             {
-               throw std::invalid_argument("Operation '<' exceeded octave range.");
-             }
-            break;
+   bool Oscillator::periodic() const
+    {
+      return oscillator->periodic();
+    }
 
-         case 'T':
-            command.consume();
-            currentTempo = command.getNumber();
-            if ((currentTempo < 16) || (currentTempo > 256))
-             {
-               throw std::invalid_argument("Asked to play music either too slow or too fast.");
-             }
-            noteLength = 240.0 / (currentBeatNote * currentTempo);
-            break;
+#ifdef TD_SOUND_FIXED_POINT
+   int Oscillator::fixedNote(uint32_t phase) const
+    {
+      return oscillator->fixedNote(phase);
+    }
+#endif
 
-         case 'L':
-            command.consume();
-            currentBeatNote = command.getNumber();
-            if ((currentBeatNote < 1) || (currentBeatNote > 64))
+   bool Oscillator::operator< (const Oscillator& rhs) const
+    {
+      return oscillator.owner_before(rhs.oscillator);
+    }
+
+   Oscillator Oscillator::makeSineWaveOscillator()
+    {
+      static std::shared_ptr<OscillatorImpl> theSineWaveGenerator = std::make_shared<SineWaveOscillator>();
+      return Oscillator(theSineWaveGenerator);
+    }
+
+   Oscillator Oscillator::makeTriangularWaveOscillator()
+    {
+      static std::shared_ptr<OscillatorImpl> theTriangularWaveGenerator = std::make_shared<TriangularWaveOscillator>();
+      return Oscillator(theTriangularWaveGenerator);
+    }
+
+   Oscillator Oscillator::makeSquareWaveOscillator()
+    {
+      static std::shared_ptr<OscillatorImpl> theSquareWaveGenerator = std::make_shared<SquareWaveOscillator>();
+      return Oscillator(theSquareWaveGenerator);
+    }
+
+   Oscillator Oscillator::makeSawWaveOscillator()
+    {
+      static std::shared_ptr<OscillatorImpl> theSawWaveGenerator = std::make_shared<SawWaveOscillator>();
+      return Oscillator(theSawWaveGenerator);
+    }
+
+   Oscillator Oscillator::makeNoiseOscillator()
+    {
+      static std::shared_ptr<OscillatorImpl> theNoiseGenerator = std::make_shared<NoiseOscillator>();
+      return Oscillator(theNoiseGenerator);
+    }
+
+   Oscillator Oscillator::makeRectangularWaveOscillator(double dutyCycle)
+    {
+      return Oscillator(std::make_shared<RectangularWaveOscillator>(dutyCycle));
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   int EnvelopeImpl::fixedLoud(uint32_t sample, uint32_t releaseSample, uint32_t sampleRate) const
+    {
+      return static_cast<int>(loud(static_cast<double>(sample) / sampleRate,
+         ((notReleased == releaseSample) ? -1.0 : static_cast<double>(releaseSample) / sampleRate)) * Q15One);
+    }
+#endif
+
+   EnvelopeImpl::~EnvelopeImpl() { }
+
+   class AREnvelope : public EnvelopeImpl
+    {
+   private:
+      double attackPeak;
+      double attackLength;
+      double releaseLength;
+#ifdef TD_SOUND_FIXED_POINT
+      // Lengths in nanoseconds, so that they can be turned into samples without floating point.
+      int fixedPeak = static_cast<int>(attackPeak * Q15One);
+      uint64_t attackNanos = static_cast<uint64_t>(attackLength * 1e9);
+      uint64_t releaseNanos = static_cast<uint64_t>(releaseLength * 1e9);
+#endif
+
+   public:
+      AREnvelope() : attackPeak(1.0), attackLength(240.0 / (64 * 256) * 0.1), releaseLength(240.0 / (64 * 256) * 0.1) { }
+
+      double loud(double time, double releaseTime) const override
+       {
+         double result = 0.0;
+         if (-1.0 == releaseTime) //The note hasn't been released yet.
+          {
+            if (time < attackLength)
              {
-               throw std::invalid_argument("Invalid note length.");
+               result = (time / attackLength) * attackPeak;
              }
-            noteLength = 240.0 / (currentBeatNote * currentTempo);
-            break;
-
-         case 'O':
-            command.consume();
-            currentOctave = command.getNumber();
-            if (octavesImplemented <= currentOctave)
+            else
              {
-               throw std::invalid_argument("Set current octave too high.");
+               result = attackPeak;
              }
-            break;
-
-         case 'N':
+          }
+         else
           {
-            command.consume();
-            int note = command.getNumber();
-            if (note > totalNotes) // We will subtract one from note.
+            if (releaseTime < attackLength)
              {
-               throw std::invalid_argument("Invalid note number.");
+               result = (time / attackLength) * attackPeak;
              }
-            if (0 != note)
+            else
              {
-               notes.emplace_back(instrument, pitches[note - 1], time, noteLength * articulation, volume);
+               result = attackPeak;
              }
-            time += noteLength;
+            result = result * ((releaseTime + releaseLength - time) / releaseLength);
           }
-            break;
+         return result;
+       }
 
-         case 'P':
-         case 'R': // Because "pauses" are RESTS
+      double release() const override
+       {
+         return releaseLength;
+       }
+
+#ifdef TD_SOUND_FIXED_POINT
+      int fixedLoud(uint32_t sample, uint32_t releaseSample, uint32_t sampleRate) const override
+       {
+         int64_t attackSamples = std::max<int64_t>(attackNanos * sampleRate / 1000000000U, 1);
+         int64_t releaseSamples = std::max<int64_t>(releaseNanos * sampleRate / 1000000000U, 1);
+         int64_t result = 0;
+         uint32_t reached = (notReleased == releaseSample) ? sample : releaseSample;
+         if (reached < attackSamples)
           {
-            command.consume();
-            double tempLength = noteLength;
-            // Allow no length to be specified, to indicate using the current note length, just like for notes.
-            if ((command.peek() >= '0') && (command.peek() <= '9'))
-            {
-               int length = command.getNumber();
-               // I have a specification that says that a zero length here is a no-op. I don't like that.
-               if ((length < 1) || (length > 64))
-                {
-                  throw std::invalid_argument("Invalid note length.");
-                }
-               tempLength = 240.0 / (length * currentTempo);
-            }
-            double nextDot = tempLength * 0.5;
-            while ('.' == command.peek())
-             {
-               command.consume();
-               tempLength += nextDot;
-               nextDot *= 0.5;
-             }
-            time += tempLength;
+            result = sample * fixedPeak / attackSamples;
           }
-            break;
+         else
+          {
+            result = fixedPeak;
+          }
+         if (notReleased != releaseSample)
+          {
+            result = result * (static_cast<int64_t>(releaseSample) + releaseSamples - sample) / releaseSamples;
+          }
+         return static_cast<int>(result);
+       }
+#endif
+    };
 
-         case 'M':
-            command.consume();
-            switch (command.peek())
-             {
-            case 'F':
-            case 'B':
-               // No support for foreground or background music.
-               command.consume();
-               break;
-            case 'L':
-               command.consume();
+   Envelope::Envelope(const std::shared_ptr<EnvelopeImpl>& envelope) : envelope(envelope) { }
+
+   double Envelope::loud(double time, double releaseTime) const
+    {
+      return envelope->loud(time, releaseTime);
+    }
+
+   double Envelope::release() const
+    {
+      return envelope->release();
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   int Envelope::fixedLoud(uint32_t sample, uint32_t releaseSample, uint32_t sampleRate) const
+    {
+      return envelope->fixedLoud(sample, releaseSample, sampleRate);
+    }
+#endif
+
+   bool Envelope::operator< (const Envelope& rhs) const
+    {
+      return envelope.owner_before(rhs.envelope);
+    }
+
+   Envelope Envelope::makeDefaultAREnvelope()
+    {
+      static std::shared_ptr<EnvelopeImpl> defaultAR = std::make_shared<AREnvelope>();
+      return Envelope(defaultAR);
+    }
+
+   Instrument::Instrument(Oscillator oscillator, Envelope envelope) : oscillator(oscillator), envelope(envelope) { }
+
+   double Instrument::note(double frequency, double time, double releaseTime) const
+    {
+      return envelope.loud(time, releaseTime) * oscillator.note(frequency, time);
+    }
+
+   double Instrument::release() const
+    {
+      return envelope.release();
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   int Instrument::fixedNote(double frequency, uint32_t phase, uint32_t sample, uint32_t releaseSample, uint32_t sampleRate) const
+    {
+      int wave = (true == oscillator.periodic()) ? oscillator.fixedNote(phase) :
+         static_cast<int>(oscillator.note(frequency, static_cast<double>(sample) / sampleRate) * Q15One);
+      return static_cast<int>((static_cast<int64_t>(envelope.fixedLoud(sample, releaseSample, sampleRate)) * wave) >> 15);
+    }
+#endif
+
+   bool Instrument::operator< (const Instrument& rhs) const
+    {
+      return std::tie(oscillator, envelope) < std::tie(rhs.oscillator, rhs.envelope);
+    }
+
+   Instrument Instrument::tabulate(CycleCache& cache, double frequency) const
+    {
+      return Instrument(cache.find(oscillator, frequency), envelope);
+    }
+
+   Instrument Instrument::makeSineWaveInstrument()
+    {
+      return Instrument(Oscillator::makeSineWaveOscillator(), Envelope::makeDefaultAREnvelope());
+    }
+
+   Instrument Instrument::makeTriangularWaveInstrument()
+    {
+      return Instrument(Oscillator::makeTriangularWaveOscillator(), Envelope::makeDefaultAREnvelope());
+    }
+
+   Instrument Instrument::makeSquareWaveInstrument()
+    {
+      return Instrument(Oscillator::makeSquareWaveOscillator(), Envelope::makeDefaultAREnvelope());
+    }
+
+   Instrument Instrument::makeSawWaveInstrument()
+    {
+      return Instrument(Oscillator::makeSawWaveOscillator(), Envelope::makeDefaultAREnvelope());
+    }
+
+   Instrument Instrument::makeNoiseInstrument()
+    {
+      return Instrument(Oscillator::makeNoiseOscillator(), Envelope::makeDefaultAREnvelope());
+    }
+
+   Instrument Instrument::makeRectangularWaveInstrument(double dutyCycle)
+    {
+      return Instrument(Oscillator::makeRectangularWaveOscillator(dutyCycle), Envelope::makeDefaultAREnvelope());
+    }
+
+   // Cache ids start from one, and are never used again.
+   static uint64_t newCacheId()
+    {
+      static std::atomic<uint64_t> last (0U);
+      return last.fetch_add(1U, std::memory_order_relaxed) + 1U;
+    }
+
+   CycleCache::CycleCache(size_t maxBytes, size_t tableSize) : tables(), lock(), tableSize(tableSize), budget(maxBytes), used(0U), id(newCacheId()) { }
+
+   Oscillator CycleCache::find(const Oscillator& oscillator, double frequency)
+    {
+      if ((false == oscillator.periodic()) || (frequency <= 0.0))
+       {
+         return oscillator;
+       }
+      std::lock_guard<std::mutex> guard (lock);
+      Key key (oscillator, frequency);
+      auto found = tables.find(key);
+      if (tables.end() != found)
+       {
+         return found->second;
+       }
+      if ((used + tableSize * sizeof(float)) > budget)
+       {
+         return oscillator;
+       }
+      used += tableSize * sizeof(float);
+      Oscillator result (std::make_shared<CycleTableOscillator>(oscillator, frequency, tableSize));
+      tables.insert(std::make_pair(key, result));
+      return result;
+    }
+
+   size_t CycleCache::bytesUsed()
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      return used;
+    }
+
+   void CycleCache::clear()
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      tables.clear(); // Notes that have been tabulated keep their tables.
+      used = 0U;
+    }
+
+   uint64_t CycleCache::getId() const
+    {
+      return id;
+    }
+
+   NoteCache::NoteCache(double sampleRate, size_t maxBytes) : renderings(), lock(), step(1.0 / sampleRate), budget(maxBytes), used(0U), id(newCacheId()) { }
+
+   std::shared_ptr<const std::vector<float> > NoteCache::find(const Instrument& instrument, double frequency, double duration)
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      Key key (instrument, frequency, duration);
+      auto found = renderings.find(key);
+      if (renderings.end() != found)
+       {
+         return found->second;
+       }
+
+      // One extra sample, so that rounding to the nearest sample never falls off the end.
+      size_t length = static_cast<size_t>((duration + instrument.release()) / step) + 2U;
+      if ((used + length * sizeof(float)) > budget)
+       {
+         return nullptr;
+       }
+      std::vector<float> samples (length, 0.0f);
+      for (size_t i = 0U; i < length; ++i)
+       {
+         double time = i * step;
+         samples[i] = static_cast<float>(instrument.note(frequency, time, ((time < duration) ? -1.0 : duration)));
+       }
+      used += length * sizeof(float);
+      std::shared_ptr<const std::vector<float> > result = std::make_shared<const std::vector<float> >(std::move(samples));
+      renderings.insert(std::make_pair(key, result));
+      return result;
+    }
+
+   double NoteCache::getStep() const
+    {
+      return step;
+    }
+
+   size_t NoteCache::bytesUsed()
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      return used;
+    }
+
+   void NoteCache::clear()
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      renderings.clear(); // Notes that have been memoized keep their renderings.
+      used = 0U;
+    }
+
+   uint64_t NoteCache::getId() const
+    {
+      return id;
+    }
+
+   Note::Note(Instrument instrument, double frequency, double startTime, double duration, double volume) :
+      instrument(instrument), original(instrument), frequency(frequency), duration(duration), volume(volume), startTime(startTime), rendering(), renderStep(0.0)
+#ifdef TD_SOUND_FIXED_POINT
+      , fixedRate(0U), startSample(0U), durationSamples(0U), endSample(0U), phaseStart(0U), phaseStep(0U), fixedVolume(0)
+#endif
+    { }
+
+   bool Note::before (double time) const
+    {
+      return time < startTime;
+    }
+
+   bool Note::after (double time) const
+    {
+      return time > end();
+    }
+
+   double Note::end () const
+    {
+      return startTime + duration + instrument.release();
+    }
+
+   template <typename Sample> Sample Note::play (double time) const
+    {
+      double noteTime = time - startTime;
+      if (nullptr != rendering)
+       {
+         size_t sample = static_cast<size_t>(noteTime / renderStep + 0.5);
+         return (sample < rendering->size()) ? static_cast<Sample>(volume) * (*rendering)[sample] : Sample(0);
+       }
+      return static_cast<Sample>(volume * instrument.note(frequency, noteTime, ((noteTime < duration) ? -1.0 : duration)));
+    }
+
+   void Note::memoize (NoteCache& cache)
+    {
+      rendering = cache.find(instrument, frequency, duration);
+      renderStep = cache.getStep();
+    }
+
+   void Note::tabulate (CycleCache& cache)
+    {
+      instrument = original.tabulate(cache, frequency);
+      rendering = nullptr; // It was of the old instrument.
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   // All of the floating point happens here, once per note.
+   void Note::fix (uint32_t sampleRate)
+    {
+      fixedRate = sampleRate;
+      // Agree exactly with before and after, when sample n is played at time n * step.
+      double step = 1.0 / sampleRate;
+      startSample = static_cast<size_t>(std::ceil(startTime * sampleRate));
+      while ((0U != startSample) && (false == before((startSample - 1U) * step)))
+       {
+         --startSample;
+       }
+      while (true == before(startSample * step))
+       {
+         ++startSample;
+       }
+      endSample = static_cast<size_t>(std::floor((startTime + duration + instrument.release()) * sampleRate));
+      while (true == after(endSample * step))
+       {
+         --endSample;
+       }
+      while (false == after((endSample + 1U) * step))
+       {
+         ++endSample;
+       }
+      durationSamples = static_cast<uint32_t>(std::ceil(duration * sampleRate));
+      // The note starts between samples: start the phase where the note would be at the first sample.
+      double cycles = (static_cast<double>(startSample) / sampleRate - startTime) * frequency;
+      phaseStart = static_cast<uint32_t>((cycles - std::floor(cycles)) * Q32Cycle);
+      phaseStep = static_cast<uint32_t>(std::fmod(std::round(frequency / sampleRate * Q32Cycle), Q32Cycle));
+      fixedVolume = static_cast<int>(volume * Q15One);
+    }
+
+   bool Note::beforeSample (size_t sample) const
+    {
+      return sample < startSample;
+    }
+
+   bool Note::afterSample (size_t sample) const
+    {
+      return sample > endSample;
+    }
+
+   int Note::playFixed (size_t sample) const
+    {
+      uint32_t noteSample = static_cast<uint32_t>(sample - startSample);
+      uint32_t phase = phaseStart + noteSample * phaseStep; // This is the phase accumulator: it wraps every cycle.
+      int result = instrument.fixedNote(frequency, phase, noteSample,
+         ((noteSample < durationSamples) ? EnvelopeImpl::notReleased : durationSamples), fixedRate);
+      return static_cast<int>((static_cast<int64_t>(result) * fixedVolume) >> 15);
+    }
+#endif
+
+   Voice::Part::Part(const std::vector<Note>& notes) :
+      notes(notes), tabulated(0U), memoized(0U), fixedRate(0U), length(0.0), latestEnd(), mostActive(0U), rehearsing(), rehearsal()
+    {
+      latestEnd.reserve(notes.size());
+      std::vector<double> ends;
+      ends.reserve(notes.size());
+      for (const Note& note : notes)
+       {
+         length = std::max(length, note.end());
+         latestEnd.push_back(length);
+         ends.push_back(note.end());
+       }
+      // A note is active from the first sample that it isn't before, through the first sample that it is after.
+      // So, one that ended in the last sample can be active alongside one that starts in this sample: stretch each note
+      // by the longest sample we plan for, and count the most that overlap, as each note starts.
+      std::sort(ends.begin(), ends.end());
+      const double longestStep = 1.0 / slowestRate;
+      size_t over = 0U;
+      for (size_t i = 0U; i < notes.size(); ++i)
+       {
+         while ((over < ends.size()) && (true == notes[i].before(ends[over] + longestStep))) // Over by the time this starts.
+          {
+            ++over;
+          }
+         mostActive = std::max(mostActive, i + 1U - over);
+       }
+    }
+
+   Voice::Part::Part(const Part& other) :
+      notes(other.notes), tabulated(other.tabulated), memoized(other.memoized), fixedRate(other.fixedRate), length(other.length),
+      latestEnd(other.latestEnd), mostActive(other.mostActive), rehearsing(), rehearsal()
+    { }
+
+   // The notes must be ours alone.
+   void Voice::Part::rehearse(CycleCache* cycles, NoteCache* cache, uint32_t sampleRate)
+    {
+      if ((nullptr != cycles) && (cycles->getId() != tabulated))
+       {
+         for (auto& note : notes)
+          {
+            note.tabulate(*cycles);
+          }
+         tabulated = cycles->getId();
+         memoized = 0U; // The note cache is keyed on the instrument, which just changed.
+       }
+      if ((nullptr != cache) && (cache->getId() != memoized))
+       {
+         for (auto& note : notes)
+          {
+            note.memoize(*cache);
+          }
+         memoized = cache->getId();
+       }
+#ifdef TD_SOUND_FIXED_POINT
+      if ((0U != sampleRate) && (sampleRate != fixedRate))
+       {
+         for (auto& note : notes)
+          {
+            note.fix(sampleRate);
+          }
+         fixedRate = sampleRate;
+       }
+#else
+      static_cast<void>(sampleRate);
+#endif
+    }
+
+   Voice::Voice() : part(std::make_shared<Part>(std::vector<Note>())), index(0U), activeNotes() { }
+   Voice::Voice(const std::vector<Note>& notes) : part(std::make_shared<Part>(notes)), index(0U), activeNotes() { }
+
+   // Play from these notes (a copy of ours), with the active notes pointing into them.
+   void Voice::adopt(const std::shared_ptr<Part>& notes)
+    {
+      for (const Note*& note : activeNotes)
+       {
+         note = &notes->notes[note - part->notes.data()];
+       }
+      part = notes;
+    }
+
+   void Voice::rehearse(CycleCache* cycles, NoteCache* notes, uint32_t sampleRate)
+    {
+      // What the notes should have done to them, once we're done.
+      uint64_t tabulated = (nullptr != cycles) ? cycles->getId() : part->tabulated;
+      uint64_t memoized = (nullptr != notes) ? notes->getId() : ((tabulated == part->tabulated) ? part->memoized : 0U);
+#ifdef TD_SOUND_FIXED_POINT
+      uint32_t fixedRate = (0U != sampleRate) ? sampleRate : part->fixedRate;
+#else
+      uint32_t fixedRate = part->fixedRate;
+#endif
+      auto done = [&](const Part& rehearsed)
+       { return (tabulated == rehearsed.tabulated) && (memoized == rehearsed.memoized) && (fixedRate == rehearsed.fixedRate); };
+      if (true == done(*part))
+       {
+         return;
+       }
+      if (1 == part.use_count()) // No one else can see them, so do it in place.
+       {
+         part->rehearse(cycles, notes, sampleRate);
+         part->rehearsal.reset();
+         return;
+       }
+      std::shared_ptr<Part> rehearsed;
+       {
+         std::lock_guard<std::mutex> guard (part->rehearsing);
+         if ((nullptr == part->rehearsal) || (false == done(*part->rehearsal)))
+          {
+            std::shared_ptr<Part> copy = std::make_shared<Part>(*part);
+            copy->rehearse(cycles, notes, sampleRate);
+            part->rehearsal = copy; // Published under the lock, and never changed again.
+          }
+         rehearsed = part->rehearsal;
+       }
+      adopt(rehearsed);
+    }
+
+   template <typename Sample> Sample Voice::endPlay(double time)
+    {
+      Sample result = playActive<Sample>(time);
+      activeNotes.erase(std::remove_if(activeNotes.begin(), activeNotes.end(), [=](const Note* note) { return note->after(time); }), activeNotes.end());
+      return result;
+    }
+
+   template <typename Sample> Sample Voice::play (double time)
+    {
+      const std::vector<Note>& notes = part->notes;
+      // Skip all passed notes.
+      while ((index < notes.size()) && (true == notes[index].after(time)))
+       {
+         ++index;
+       }
+      // Exit if we are done.
+      if (index == notes.size())
+       {
+         return endPlay<Sample>(time);
+       }
+      // If this note hasn't started, we are resting.
+      if ((index < notes.size()) && (true == notes[index].before(time)))
+       {
+         return endPlay<Sample>(time);
+       }
+      // We must be playing this note right now.
+      while ((index < notes.size()) && (false == notes[index].before(time)))
+       {
+         activeNotes.push_back(&(notes[index]));
+         ++index;
+       }
+      return endPlay<Sample>(time);
+    }
+
+   template <typename Sample> size_t Voice::render(Sample* out, size_t count, size_t firstSample, double step)
+    {
+      size_t result = 0U;
+      while ((result < count) && (false == finished()))
+       {
+         out[result] = play<Sample>((firstSample + result) * step);
+         ++result;
+       }
+      std::fill(out + result, out + count, Sample(0));
+      return result;
+    }
+
+   template <typename Sample> size_t Voice::renderRange(Sample* out, size_t count, size_t firstSample, double step) const
+    {
+      Voice cursor (*this); // Shares the notes.
+      cursor.seek((0U == firstSample) ? -step : (firstSample - 1U) * step);
+      return cursor.render<Sample>(out, count, firstSample, step);
+    }
+
+   template <typename Sample> Sample Voice::playActive(double time) const
+    {
+      Sample sum = 0;
+      for (const Note * note : activeNotes)
+       {
+         sum += note->play<Sample>(time);
+       }
+      return sum;
+    }
+
+   bool Voice::finished() const
+    {
+      return (index == part->notes.size() && (0U == activeNotes.size()));
+    }
+
+   void Voice::loop()
+    {
+      index = 0U;
+      activeNotes.clear();
+    }
+
+   double Voice::length() const
+    {
+      return part->length;
+    }
+
+   void Voice::seek(double time)
+    {
+      // The notes are in order of their start. After playing time, every note that has started has been taken,
+      // and the ones that are still playing (in that same order) are active.
+      const std::vector<Note>& notes = part->notes;
+      index = std::upper_bound(notes.begin(), notes.end(), time, [](double when, const Note& note) { return note.before(when); }) - notes.begin();
+      size_t first = index;
+      while ((0U != first) && (part->latestEnd[first - 1U] >= time)) // Could anything before this still be playing?
+       {
+         --first;
+       }
+      activeNotes.clear();
+      for (size_t i = first; i < index; ++i)
+       {
+         if (false == notes[i].after(time))
+          {
+            activeNotes.push_back(&notes[i]);
+          }
+       }
+    }
+
+   void Voice::reserve()
+    {
+      activeNotes.reserve(part->mostActive);
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   int Voice::endPlayFixed(size_t sample)
+    {
+      int result = 0;
+      for (const Note * note : activeNotes)
+       {
+         result += note->playFixed(sample);
+       }
+      activeNotes.erase(std::remove_if(activeNotes.begin(), activeNotes.end(), [=](const Note* note) { return note->afterSample(sample); }),
+         activeNotes.end());
+      return result;
+    }
+
+   void Voice::fix(uint32_t sampleRate)
+    {
+      rehearse(nullptr, nullptr, sampleRate);
+    }
+
+   bool Voice::fixedAt(uint32_t sampleRate) const
+    {
+      return sampleRate == part->fixedRate;
+    }
+
+   size_t Voice::renderRangeFixed(int* out, size_t count, size_t firstSample, double step) const
+    {
+      Voice cursor (*this);
+      cursor.seek((0U == firstSample) ? -step : (firstSample - 1U) * step);
+      size_t result = 0U;
+      while ((result < count) && (false == cursor.finished()))
+       {
+         out[result] = cursor.playFixed(firstSample + result);
+         ++result;
+       }
+      std::fill(out + result, out + count, 0);
+      return result;
+    }
+
+   // This is play, but with time in samples.
+   int Voice::playFixed(size_t sample)
+    {
+      const std::vector<Note>& notes = part->notes;
+      while ((index < notes.size()) && (true == notes[index].afterSample(sample)))
+       {
+         ++index;
+       }
+      if ((index < notes.size()) && (true == notes[index].beforeSample(sample)))
+       {
+         return endPlayFixed(sample);
+       }
+      while ((index < notes.size()) && (false == notes[index].beforeSample(sample)))
+       {
+         activeNotes.push_back(&(notes[index]));
+         ++index;
+       }
+      return endPlayFixed(sample);
+    }
+#endif
+
+   void Voice::memoize(NoteCache& cache)
+    {
+      rehearse(nullptr, &cache, 0U);
+    }
+
+   void Voice::tabulate(CycleCache& cache)
+    {
+      rehearse(&cache, nullptr, 0U);
+    }
+
+   std::map<char, Instrument> makeDefaultInstrument()
+    {
+      std::map<char, Instrument> result;
+      result.insert(std::make_pair('\0', Instrument::makeSquareWaveInstrument()));
+      return result;
+    }
+
+   const std::map<char, Instrument>& getDefaultInstrument()
+    {
+      static const std::map<char, Instrument> instruments = makeDefaultInstrument();
+      return instruments;
+    }
+
+   class StringProcessor
+    {
+   public:
+      const std::string& input;
+      size_t location;
+      char peeked;
+
+      StringProcessor(const std::string& input) : input(input), location(0U), peeked('\0')
+       {
+         if (0U != input.length())
+          {
+            peeked = std::toupper(static_cast<unsigned char>(input[0]));
+            // std::isspace doesn't return true, it returns not false
+            if (false != std::isspace(static_cast<unsigned char>(peeked)))
+             {
+               peeked = getNextChar();
+             }
+          }
+       }
+
+      bool done () const
+       {
+         return location == input.length();
+       }
+
+      char getNextChar()
+       {
+         bool gotNext = false;
+         char result = '\0';
+         while (false == gotNext)
+          {
+            ++location;
+            if (location == input.length())
+             {
+               gotNext = true;
+             }
+            else if (false == std::isspace(static_cast<unsigned char>(input[location])))
+             {
+               gotNext = true;
+               result = std::toupper(static_cast<unsigned char>(input[location]));
+             }
+          }
+         return result;
+       }
+
+      char peek () const
+       {
+         return peeked;
+       }
+
+      char consume ()
+       {
+         char result = peeked;
+         peeked = getNextChar();
+         return result;
+       }
+
+      int getNumber ()
+       {
+         int number = 0;
+         bool firstChar = true;
+         bool keepLooking = true;
+         while (true == keepLooking)
+          {
+            switch (peek())
+             {
+               case '0':
+               case '1':
+               case '2':
+               case '3':
+               case '4':
+               case '5':
+               case '6':
+               case '7':
+               case '8':
+               case '9':
+                  number = number * 10 + (consume() - '0');
+                  break;
+               default:
+                  if (true == firstChar)
+                   {
+                     throw std::invalid_argument("Command requires value, none given.");
+                   }
+                  keepLooking = false;
+                  break;
+             }
+            firstChar = false;
+          }
+         return number;
+       }
+    };
+
+   Voice buildVoiceFromString(const std::string& input, const std::map<char, Instrument>& instruments, const std::vector<double>& inPitches)
+    {
+      static const int map [] = { 9, 11, 0, 2, 4, 5, 7 };
+
+      int currentOctave = 4;
+      int currentBeatNote = 4;
+      int currentTempo = 120;
+      double articulation = 7.0 / 8.0;
+      // Length in seconds of each note. There are 60 seconds in a minute, but tempo is in quarter notes per minute.
+      //          sec / 4minute      beats / note      note / 4minute
+      double noteLength = 240.0 / (currentBeatNote * currentTempo);
+      double volume = 0.5;
+      double time = 0.0;
+
+      std::vector<Note> notes;
+
+      if (totalNotes != static_cast<int>(inPitches.size()))
+       {
+         throw std::invalid_argument("Note array of invalid size.");
+       }
+      std::vector<double> pitches = inPitches;
+
+      if (instruments.find('\0') == instruments.end())
+       {
+         throw std::invalid_argument("No default instrument in instrument list.");
+       }
+      Instrument instrument = instruments.find('\0')->second;
+
+      StringProcessor command (input);
+
+      while (false == command.done())
+       {
+         switch (command.peek())
+          {
+         case 'A':
+         case 'B':
+         case 'C':
+         case 'D':
+         case 'E':
+         case 'F':
+         case 'G':
+          {
+            int in = map[command.consume() - 'A'];
+            int note = currentOctave * notesPerOctave + in;
+
+            double tempDuration = articulation;
+            double tempLength = noteLength;
+            double tempVolume = volume;
+
+            bool modifiers = true;
+            bool advance = true;
+            double nextDot = tempLength * 0.5;
+            while (true == modifiers)
+             {
+               switch (command.peek())
+                {
+               case '+':
+               case '#':
+                  command.consume();
+                  ++note;
+                  if (totalNotes == note)
+                   {
+                     throw std::invalid_argument("Tried to sharp the highest note.");
+                   }
+                  break;
+               case '-':
+                  command.consume();
+                  --note;
+                  if (-1 == note)
+                   {
+                     throw std::invalid_argument("Tried to flat the lowest note.");
+                   }
+                  break;
+               case '.':
+                  command.consume();
+                  tempLength += nextDot;
+                  nextDot *= 0.5;
+                  break;
+               case '1': // This modifier/suffix overrides the length of the note.
+               case '2': // It MUST occur before a '.'.
+               case '3':
+               case '4':
+               case '5':
+               case '6':
+               case '7':
+               case '8':
+               case '9':
+                {
+                  int length = command.getNumber();
+                  if ((length < 1) || (length > 64))
+                   {
+                     throw std::invalid_argument("Invalid note length.");
+                   }
+                  tempLength = 240.0 / (length * currentTempo);
+                  nextDot = tempLength * 0.5;
+                }
+                  break;
+               case '_':
+                  command.consume();
+                  tempDuration = 1.0;
+                  break;
+               case '\'':
+                  command.consume();
+                  tempDuration = 3.0 / 4.0;
+                  break;
+               case '^':
+                  command.consume();
+                  tempVolume = std::min(tempVolume + 0.125, 1.0);
+                  break;
+               case ',':
+                  command.consume();
+                  modifiers = false;
+                  advance = false;
+                  break;
+               default:
+                  modifiers = false;
+                  break;
+                }
+             }
+
+            notes.emplace_back(instrument, pitches[note], time, tempLength * tempDuration, tempVolume);
+            if (true == advance)
+             {
+               time += tempLength;
+             }
+          }
+            break;
+
+         case '>':
+            command.consume();
+            ++currentOctave;
+            if (octavesImplemented == currentOctave)
+             {
+               throw std::invalid_argument("Operation '>' exceeded octave range.");
+             }
+            break;
+
+         case '<':
+            command.consume();
+            --currentOctave;
+            if (-1 == currentOctave)
+             {
+               throw std::invalid_argument("Operation '<' exceeded octave range.");
+             }
+            break;
+
+         case 'T':
+            command.consume();
+            currentTempo = command.getNumber();
+            if ((currentTempo < 16) || (currentTempo > 256))
+             {
+               throw std::invalid_argument("Asked to play music either too slow or too fast.");
+             }
+            noteLength = 240.0 / (currentBeatNote * currentTempo);
+            break;
+
+         case 'L':
+            command.consume();
+            currentBeatNote = command.getNumber();
+            if ((currentBeatNote < 1) || (currentBeatNote > 64))
+             {
+               throw std::invalid_argument("Invalid note length.");
+             }
+            noteLength = 240.0 / (currentBeatNote * currentTempo);
+            break;
+
+         case 'O':
+            command.consume();
+            currentOctave = command.getNumber();
+            if (octavesImplemented <= currentOctave)
+             {
+               throw std::invalid_argument("Set current octave too high.");
+             }
+            break;
+
+         case 'N':
+          {
+            command.consume();
+            int note = command.getNumber();
+            if (note > totalNotes) // We will subtract one from note.
+             {
+               throw std::invalid_argument("Invalid note number.");
+             }
+            if (0 != note)
+             {
+               notes.emplace_back(instrument, pitches[note - 1], time, noteLength * articulation, volume);
+             }
+            time += noteLength;
+          }
+            break;
+
+         case 'P':
+         case 'R': // Because "pauses" are RESTS
+          {
+            command.consume();
+            double tempLength = noteLength;
+            // Allow no length to be specified, to indicate using the current note length, just like for notes.
+            if ((command.peek() >= '0') && (command.peek() <= '9'))
+            {
+               int length = command.getNumber();
+               // I have a specification that says that a zero length here is a no-op. I don't like that.
+               if ((length < 1) || (length > 64))
+                {
+                  throw std::invalid_argument("Invalid note length.");
+                }
+               tempLength = 240.0 / (length * currentTempo);
+            }
+            double nextDot = tempLength * 0.5;
+            while ('.' == command.peek())
+             {
+               command.consume();
+               tempLength += nextDot;
+               nextDot *= 0.5;
+             }
+            time += tempLength;
+          }
+            break;
+
+         case 'M':
+            command.consume();
+            switch (command.peek())
+             {
+            case 'F':
+            case 'B':
+               // No support for foreground or background music.
+               command.consume();
+               break;
+            case 'L':
+               command.consume();
                articulation = 1.0;
                break;
-            case 'N':
+            case 'N':
+               command.consume();
+               articulation = 7.0 / 8.0;
+               break;
+            case 'S':
+               command.consume();
+               articulation = 3.0 / 4.0;
+               break;
+            case 'A':
+             {
+               command.consume();
+               int freq = command.getNumber();
+               pitches = generateTwelveToneEqual(freq);
+             }
+               break;
+            default:
+               throw std::invalid_argument(std::string("Did not understand music ('M') command component \'") + command.peek() + "\'.");
+             }
+            break;
+
+         case 'I':
+            command.consume();
+            switch(command.peek())
+             {
+            case 'Q':
+               command.consume();
+               instrument = Instrument::makeSquareWaveInstrument();
+               break;
+            case 'T':
+               command.consume();
+               instrument = Instrument::makeTriangularWaveInstrument();
+               break;
+            case 'S':
+               command.consume();
+               instrument = Instrument::makeSineWaveInstrument();
+               break;
+            case 'W':
+               command.consume();
+               instrument = Instrument::makeSawWaveInstrument();
+               break;
+            case 'N':
+               command.consume();
+               instrument = Instrument::makeNoiseInstrument();
+               break;
+            case 'X':
+               command.consume();
+               if (instruments.end() == instruments.find(command.peek()))
+                {
+                  throw std::invalid_argument("Invalid instrument.");
+                }
+               instrument = instruments.find(command.consume())->second;
+               break;
+            case 'P':
+             {
+               command.consume();
+               int dutyCycle = command.getNumber();
+               if ((dutyCycle < 1) || (dutyCycle > 99))
+                {
+                  throw std::invalid_argument("Invalid duty cycle for a rectangular wave.");
+                }
+               instrument = Instrument::makeRectangularWaveInstrument(dutyCycle / 100.0);
+             }
+               break;
+            default:
+               throw std::invalid_argument("Invalid instrument.");
+             }
+            break;
+
+         case 'V':
+            command.consume();
+            switch(command.peek())
+             {
+            case '0':
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+            case '5':
+            case '6':
+            case '7':
+            case '8':
+            case '9':
+             {
+               int newVolume = command.getNumber();
+               if (100 < newVolume)
+                {
+                  throw std::invalid_argument("Invalid volume.");
+                }
+               volume = newVolume / 100.0;
+             }
+               break;
+            case 'P': // paino
                command.consume();
-               articulation = 7.0 / 8.0;
+               if ('P' == command.peek()) // pianissimo
+                {
+                  command.consume();
+                  if ('P' == command.peek()) // pianississimo
+                   {
+                     command.consume();
+                     volume = .125;
+                   }
+                  else
+                   {
+                     volume = .25;
+                   }
+                }
+               else
+                {
+                  volume = .375;
+                }
+               if (';' == command.peek()) // Allow this to be followed by a ';' to allow playing a rest after changing the volume.
+                {
+                  command.consume();
+                }
                break;
-            case 'S':
+            case 'M':
                command.consume();
-               articulation = 3.0 / 4.0;
+               if ('P' == command.peek()) // mezzo-piano
+                {
+                  command.consume();
+                  volume = 0.5;
+                }
+               else if ('F' == command.peek()) // mezzo-forte
+                {
+                  command.consume();
+                  volume = .625;
+                }
+               else
+                {
+                  throw std::invalid_argument("Invalid volume specification: mezzo-I-don't-know.");
+                }
+               if (';' == command.peek()) // For consistency
+                {
+                  command.consume();
+                }
                break;
-            case 'A':
-             {
+            case 'F':
                command.consume();
-               int freq = command.getNumber();
-               pitches = generateTwelveToneEqual(freq);
-             }
+               if ('F' != command.peek()) // forte
+                {
+                  volume = .75;
+                }
+               else
+                {
+                  command.consume();
+                  if ('F' != command.peek()) // fortissimo
+                   {
+                     volume = .875;
+                   }
+                  else // fortississimo
+                   {
+                     command.consume();
+                     volume = 1.0;
+                   }
+                }
+               if (';' == command.peek()) // Allow this to be followed by a ';' to allow playing an F after changing the volume.
+                {
+                  command.consume();
+                }
                break;
             default:
-               throw std::invalid_argument(std::string("Did not understand music ('M') command component \'") + command.peek() + "\'.");
+               throw std::invalid_argument("Invalid volume specification.");
              }
             break;
 
-         case 'I':
-            command.consume();
-            switch(command.peek())
-             {
-            case 'Q':
-               command.consume();
-               instrument = Instrument::makeSquareWaveInstrument();
-               break;
-            case 'T':
-               command.consume();
-               instrument = Instrument::makeTriangularWaveInstrument();
-               break;
-            case 'S':
-               command.consume();
-               instrument = Instrument::makeSineWaveInstrument();
-               break;
-            case 'W':
-               command.consume();
-               instrument = Instrument::makeSawWaveInstrument();
-               break;
-            case 'N':
-               command.consume();
-               instrument = Instrument::makeNoiseInstrument();
-               break;
-            case 'X':
-               command.consume();
-               if (instruments.end() == instruments.find(command.peek()))
-                {
-                  throw std::invalid_argument("Invalid instrument.");
-                }
-               instrument = instruments.find(command.consume())->second;
-               break;
-            case 'P':
-             {
-               command.consume();
-               int dutyCycle = command.getNumber();
-               if ((dutyCycle < 1) || (dutyCycle > 99))
-                {
-                  throw std::invalid_argument("Invalid duty cycle for a rectangular wave.");
-                }
-               instrument = Instrument::makeRectangularWaveInstrument(dutyCycle / 100.0);
-             }
-               break;
-            default:
-               throw std::invalid_argument("Invalid instrument.");
-             }
-            break;
+         default:
+            throw std::invalid_argument(std::string("Did not understand command component \'") + command.peek() + "\'.");
+          }
+       }
+
+      return Voice(notes);
+    }
+
+   Maestro::Maestro() : choir() { }
+
+   Maestro::Maestro(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments) : choir()
+    {
+      for (auto& voice : music)
+       {
+         choir.emplace_back(buildVoiceFromString(voice, instruments));
+         if (true == choir.back().finished()) // Throw out empty voices.
+          {
+            choir.pop_back();
+          }
+       }
+    }
+
+   Maestro::Maestro(const std::vector<Voice>& choir) : choir(choir) { }
+
+   template <typename Sample> Sample Maestro::play(double time)
+    {
+      Sample sample = 0;
+      if (0U != choir.size())
+       {
+         for (auto& voice : choir)
+         {
+            sample += voice.play<Sample>(time);
+         }
+         sample /= choir.size();
+       }
+      return sample;
+    }
+
+   static const size_t renderBlockSize = 256U;
+
+   template <typename Sample> size_t Maestro::render(Sample* out, size_t count, size_t firstSample, double step)
+    {
+      // Render each voice a block at a time, and then mix the block.
+      // The song is finished once its longest voice is.
+      Sample block [renderBlockSize];
+      size_t result = 0U;
+      while ((result < count) && (false == finished()))
+       {
+         size_t length = std::min(renderBlockSize, count - result);
+         size_t played = 0U;
+         std::fill(out + result, out + result + length, Sample(0));
+         for (auto& voice : choir)
+          {
+            played = std::max(played, voice.render<Sample>(block, length, firstSample + result, step));
+            addSamples(out + result, block, length);
+          }
+         scaleSamples(out + result, Sample(1) / choir.size(), played);
+         result += played;
+       }
+      return result;
+    }
+
+   template <typename Sample> size_t Maestro::renderRange(Sample* out, size_t count, size_t firstSample, double step) const
+    {
+      Maestro cursor (*this); // Shares the notes.
+      cursor.seek(firstSample, step);
+      return cursor.render<Sample>(out, count, firstSample, step);
+    }
+
+   template <typename Sample> size_t Maestro::renderStem(size_t voice, Sample* out, size_t count, size_t firstSample, double step) const
+    {
+      return choir[voice].renderRange<Sample>(out, count, firstSample, step);
+    }
+
+   template <typename Sample> void Maestro::mixStems(Sample* out, const Sample* const* stems, size_t voices, size_t count)
+    {
+      // The same sums, in the same order, as render.
+      std::fill(out, out + count, Sample(0));
+      for (size_t voice = 0U; voice < voices; ++voice)
+       {
+         addSamples(out, stems[voice], count);
+       }
+      if (0U != voices)
+       {
+         scaleSamples(out, Sample(1) / voices, count);
+       }
+    }
+
+   size_t Maestro::voices() const
+    {
+      return choir.size();
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   size_t Maestro::renderStem(size_t voice, int* out, size_t count, size_t firstSample, double step) const
+    {
+      return choir[voice].renderRangeFixed(out, count, firstSample, step);
+    }
+
+   void Maestro::mixStems(short* out, const int* const* stems, size_t voices, size_t count)
+    {
+      for (size_t i = 0U; i < count; ++i)
+       {
+         int sample = 0;
+         if (0U != voices)
+          {
+            for (size_t voice = 0U; voice < voices; ++voice)
+             {
+               sample += stems[voice][i];
+             }
+            sample /= static_cast<int>(voices);
+          }
+         out[i] = static_cast<short>(std::clamp(sample, -Q15One, Q15One));
+       }
+    }
+
+   void Maestro::fix(uint32_t sampleRate)
+    {
+      for (auto& voice : choir) // This only does anything the first time.
+       {
+         voice.fix(sampleRate);
+       }
+    }
+
+   bool Maestro::fixedAt(uint32_t sampleRate) const
+    {
+      bool result = true;
+      for (const auto& voice : choir)
+       {
+         result &= voice.fixedAt(sampleRate);
+       }
+      return result;
+    }
+
+   template <> size_t Maestro::render<short>(short* out, size_t count, size_t firstSample, double step)
+    {
+      fix(static_cast<uint32_t>(std::lround(1.0 / step)));
+      size_t result = 0U;
+      while ((result < count) && (false == finished()))
+       {
+         int sample = 0;
+         if (0U != choir.size())
+          {
+            for (auto& voice : choir)
+             {
+               sample += voice.playFixed(firstSample + result);
+             }
+            sample /= static_cast<int>(choir.size());
+          }
+         out[result] = static_cast<short>(std::clamp(sample, -Q15One, Q15One));
+         ++result;
+       }
+      return result;
+    }
+#endif
+
+   bool Maestro::finished() const
+    {
+      bool result = true;
+      for (auto& voice : choir)
+       {
+         result &= voice.finished();
+       }
+      return result;
+    }
+
+   double Maestro::length() const
+    {
+      double result = 0.0;
+      for (auto& voice : choir)
+       {
+         result = std::max(result, voice.length());
+       }
+      return result;
+    }
+
+   void Maestro::seek(size_t firstSample, double step)
+    {
+      if (0U == firstSample)
+       {
+         loop();
+       }
+      else
+       {
+         for (auto& voice : choir)
+          {
+            voice.seek((firstSample - 1U) * step);
+          }
+       }
+    }
+
+   void Maestro::loop()
+    {
+      for (auto& voice : choir)
+       {
+         voice.loop();
+       }
+    }
+
+   void Maestro::reserve()
+    {
+      for (auto& voice : choir)
+       {
+         voice.reserve();
+       }
+    }
+
+   void Maestro::rehearse(CycleCache* cycles, NoteCache* notes, uint32_t sampleRate)
+    {
+      for (auto& voice : choir)
+       {
+         voice.rehearse(cycles, notes, sampleRate);
+       }
+    }
+
+   void Maestro::memoize(NoteCache& cache)
+    {
+      for (auto& voice : choir)
+       {
+         voice.memoize(cache);
+       }
+    }
+
+   void Maestro::tabulate(CycleCache& cache)
+    {
+      for (auto& voice : choir)
+       {
+         voice.tabulate(cache);
+       }
+    }
+
+   Worker::Worker() : thread(), lock(), wakeUp(), jobs(), quitting(false)
+    {
+      thread = std::thread(&Worker::work, this); // Last: everything it uses is made by now.
+    }
+
+   Worker::~Worker()
+    {
+      stop();
+    }
+
+   void Worker::work()
+    {
+      std::unique_lock<std::mutex> guard (lock);
+      while (true)
+       {
+         wakeUp.wait(guard, [this]() { return (false == jobs.empty()) || (true == quitting); });
+         if (true == jobs.empty()) // Then we must be quitting.
+          {
+            return;
+          }
+         std::function<void(void)> job = std::move(jobs.front());
+         jobs.pop_front();
+         guard.unlock();
+         job();
+         guard.lock();
+       }
+    }
+
+   void Worker::post(std::function<void(void)> job)
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      jobs.push_back(std::move(job));
+      wakeUp.notify_one();
+    }
 
-         case 'V':
-            command.consume();
-            switch(command.peek())
-             {
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
-             {
-               int newVolume = command.getNumber();
-               if (100 < newVolume)
-                {
-                  throw std::invalid_argument("Invalid volume.");
-                }
-               volume = newVolume / 100.0;
-             }
-               break;
-            case 'P': // paino
-               command.consume();
-               if ('P' == command.peek()) // pianissimo
-                {
-                  command.consume();
-                  if ('P' == command.peek()) // pianississimo
-                   {
-                     command.consume();
-                     volume = .125;
-                   }
-                  else
-                   {
-                     volume = .25;
-                   }
-                }
-               else
-                {
-                  volume = .375;
-                }
-               if (';' == command.peek()) // Allow this to be followed by a ';' to allow playing a rest after changing the volume.
-                {
-                  command.consume();
-                }
-               break;
-            case 'M':
-               command.consume();
-               if ('P' == command.peek()) // mezzo-piano
-                {
-                  command.consume();
-                  volume = 0.5;
-                }
-               else if ('F' == command.peek()) // mezzo-forte
-                {
-                  command.consume();
-                  volume = .625;
-                }
-               else
-                {
-                  throw std::invalid_argument("Invalid volume specification: mezzo-I-don't-know.");
-                }
-               if (';' == command.peek()) // For consistency
-                {
-                  command.consume();
-                }
-               break;
-            case 'F':
-               command.consume();
-               if ('F' != command.peek()) // forte
-                {
-                  volume = .75;
-                }
-               else
-                {
-                  command.consume();
-                  if ('F' != command.peek()) // fortissimo
-                   {
-                     volume = .875;
-                   }
-                  else // fortississimo
-                   {
-                     command.consume();
-                     volume = 1.0;
-                   }
-                }
-               if (';' == command.peek()) // Allow this to be followed by a ';' to allow playing an F after changing the volume.
-                {
-                  command.consume();
-                }
-               break;
-            default:
-               throw std::invalid_argument("Invalid volume specification.");
+   void Worker::stop()
+    {
+       {
+         std::lock_guard<std::mutex> guard (lock);
+         quitting = true;
+       }
+      wakeUp.notify_one();
+      if (true == thread.joinable())
+       {
+         thread.join();
+       }
+    }
+
+   Venue::Venue() : program(), cues(nullptr), retired(nullptr), retiring(nullptr), finished(), effects(), finishedEffects(),
+      maxEffects(16U), stealPolicy(StealPolicy::Oldest), looping(false), preRollSamples(0U), preRollStep(0.0), crossfadeSamples(0U), loopBytes(0U), loopStep(0.0), playedStep(0.0), hollaback(nullptr),
+      callbackMode(CallbackMode::AudioThread), events(), eventsPosted(0U), eventsTaken(0U), eventsDropped(0U), dispatcher(), dispatching(false), noteCache(), cycleCache(), builder(),
+      ring(), renderer(), renderingAhead(false)
+    {
+      getKernels(); // Choose the kernels now, rather than on the audio thread.
+    }
+
+   Venue::~Venue()
+    {
+      stopRenderAhead();
+      setCallbackMode(CallbackMode::AudioThread); // Stops the dispatcher.
+      builder.stop(); // It may still be posting songs.
+      for (Cue* list : { cues.exchange(nullptr), retired.exchange(nullptr), retiring })
+       {
+         while (nullptr != list)
+          {
+            Cue* next = list->next;
+            delete list;
+            list = next;
+          }
+       }
+    }
+
+   Venue& Venue::getInstance()
+    {
+      static Venue instance;
+      return instance;
+    }
+
+   // Get a song ready to be played, before it is handed to the audio thread.
+   Maestro Venue::rehearse(Maestro song, const Staging& staging)
+    {
+      // Tabulate first, so that the note cache renders from the tables. The first song to be rehearsed with these caches
+      // does the work, and keeps it with the notes: the next copy of it to be queued only looks it up.
+      // In fixed point, fix it here too, so that the audio thread never has to.
+      song.rehearse(staging.cycles.get(), staging.notes.get(), staging.sampleRate);
+      song.reserve();
+      return song;
+    }
+
+   Venue::Staging Venue::getStaging() const
+    {
+      // The rate the audio is playing at, if it has started. If not, the best guess is the rate the song is pre-rolled or looped at.
+      double step = playedStep.load(std::memory_order_relaxed);
+      for (double guess : { preRollStep.load(std::memory_order_relaxed), loopStep.load(std::memory_order_relaxed) })
+       {
+         step = (0.0 < step) ? step : guess;
+       }
+      uint32_t sampleRate = (0.0 < step) ? static_cast<uint32_t>(std::lround(1.0 / step)) : 0U;
+      return Staging { cycleCache, noteCache, preRollSamples.load(std::memory_order_relaxed), preRollStep.load(std::memory_order_relaxed),
+         loopBytes.load(std::memory_order_relaxed), loopStep.load(std::memory_order_relaxed), sampleRate };
+    }
+
+   Venue::Performance Venue::stage(Maestro song, const Staging& staging)
+    {
+      Performance result { rehearse(song, staging), std::vector<double>(staging.preRoll), 0U, staging.preRollStep, 0U,
+         std::vector<float>(), staging.loopStep, 0U, 0U };
+      if (0U != staging.loopBytes)
+       {
+         // A little extra, in case rounding leaves the song a sample longer than it ought to be.
+         size_t samples = static_cast<size_t>(result.song.length() / staging.loopStep) + 2U;
+         if (samples <= staging.loopBytes / sizeof(float))
+          {
+            result.loop.resize(samples);
+          }
+       }
+      result.preRolled = result.song.render<double>(result.preRoll.data(), staging.preRoll, 0U, staging.preRollStep);
+      return result;
+    }
+
+   void Venue::post(Command command, std::list<Performance>&& songs, std::list<Effect>&& effects, double time)
+    {
+      reclaim();
+      Cue* cue = new Cue { command, std::move(songs), std::move(effects), time, cues.load(std::memory_order_relaxed) };
+      while (false == cues.compare_exchange_weak(cue->next, cue, std::memory_order_release, std::memory_order_relaxed)) { }
+    }
+
+   // Delete whatever the audio thread is done with.
+   void Venue::reclaim()
+    {
+      Cue* cue = retired.exchange(nullptr, std::memory_order_acquire);
+      while (nullptr != cue)
+       {
+         Cue* next = cue->next;
+         delete cue;
+         cue = next;
+       }
+    }
+
+   void Venue::queueMusic(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments)
+    {
+      std::list<Performance> songs;
+      songs.push_back(stage(Maestro(music, instruments), getStaging()));
+      post(Command::Queue, std::move(songs));
+    }
+
+   void Venue::queueMusic(const Maestro& song)
+    {
+      std::list<Performance> songs;
+      songs.push_back(stage(song, getStaging()));
+      post(Command::Queue, std::move(songs));
+    }
+
+   std::future<void> Venue::queueMusicAsync(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments)
+    {
+      // Not std::async: its future waits for the parse when it is destroyed, and the whole point is to not wait.
+      std::shared_ptr<std::promise<void> > promise = std::make_shared<std::promise<void> >();
+      Staging staging = getStaging();
+      builder.post([this, promise, music, instruments, staging]()
+       {
+         try
+          {
+            std::list<Performance> songs;
+            songs.push_back(stage(Maestro(music, instruments), staging));
+            post(Command::Queue, std::move(songs));
+            promise->set_value();
+          }
+         catch (...)
+          {
+            promise->set_exception(std::current_exception());
+          }
+       });
+      return promise->get_future();
+    }
+
+   void Venue::replaceQueue(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments)
+    {
+      std::list<Performance> songs;
+      songs.push_back(stage(Maestro(music, instruments), getStaging()));
+      post(Command::Replace, std::move(songs));
+    }
+
+   void Venue::replaceQueue(const Maestro& song)
+    {
+      std::list<Performance> songs;
+      songs.push_back(stage(song, getStaging()));
+      post(Command::Replace, std::move(songs));
+    }
+
+   void Venue::clearQueue()
+    {
+      post(Command::Clear, std::list<Performance>());
+    }
+
+   void Venue::toggleLoop()
+    {
+      post(Command::ToggleLoop, std::list<Performance>());
+    }
+
+   void Venue::playEffect(const Maestro& effect, double volume)
+    {
+      std::list<Effect> effects;
+      effects.push_back(Effect { rehearse(effect, getStaging()), volume, 0U, -1.0 });
+      post(Command::Effect, std::list<Performance>(), std::move(effects));
+    }
+
+   void Venue::setTransition(size_t preRoll, size_t crossfade, double timeDelta)
+    {
+      preRollSamples.store(preRoll, std::memory_order_relaxed);
+      preRollStep.store(timeDelta, std::memory_order_relaxed);
+      crossfadeSamples.store(crossfade, std::memory_order_relaxed);
+    }
+
+   void Venue::seek(double time)
+    {
+      post(Command::Seek, std::list<Performance>(), std::list<Effect>(), time);
+    }
+
+   void Venue::useLoopCache(size_t maxBytes, double timeDelta)
+    {
+      loopBytes.store(maxBytes, std::memory_order_relaxed);
+      loopStep.store(timeDelta, std::memory_order_relaxed);
+    }
+
+   void Venue::stopEffects()
+    {
+      post(Command::StopEffects, std::list<Performance>());
+    }
+
+   void Venue::setEffectPolyphony(size_t maxEffects, StealPolicy policy)
+    {
+      this->maxEffects.store(maxEffects, std::memory_order_relaxed);
+      stealPolicy.store(policy, std::memory_order_relaxed);
+    }
+
+   void Venue::addMusicCallback(std::function<void(void)> callOnMusicDone)
+    {
+      hollaback = callOnMusicDone;
+    }
+
+   void Venue::useNoteCache(const std::shared_ptr<NoteCache>& cache)
+    {
+      noteCache = cache;
+    }
+
+   void Venue::useCycleCache(const std::shared_ptr<CycleCache>& cache)
+    {
+      cycleCache = cache;
+    }
+
+   // Audio thread: don't delete the cue, give it back. If the last batch hasn't been picked up yet, hold on to it for now.
+   void Venue::retire(Cue* cue)
+    {
+      if (nullptr != cue)
+       {
+         cue->next = retiring;
+         retiring = cue;
+       }
+      if (nullptr != retiring) // Finished songs go back with the cue, to be deleted elsewhere.
+       {
+         retiring->songs.splice(retiring->songs.end(), finished);
+         retiring->effects.splice(retiring->effects.end(), finishedEffects);
+       }
+      // Only the audio thread ever makes retired non-null, so if it is null here, it stays that way until this store.
+      if ((nullptr != retiring) && (nullptr == retired.load(std::memory_order_relaxed)))
+       {
+         retired.store(retiring, std::memory_order_release);
+         retiring = nullptr;
+       }
+    }
+
+   // Audio thread: apply everything that has been posted, in the order it was posted. Returns true if the queue was cleared.
+   bool Venue::takeCues(double timeDelta)
+    {
+      Cue* taken = cues.exchange(nullptr, std::memory_order_acquire);
+      Cue* inOrder = nullptr; // The stack is newest first.
+      while (nullptr != taken)
+       {
+         Cue* next = taken->next;
+         taken->next = inOrder;
+         inOrder = taken;
+         taken = next;
+       }
+      bool cleared = false;
+      while (nullptr != inOrder)
+       {
+         Cue* cue = inOrder;
+         inOrder = inOrder->next;
+         switch (cue->command)
+          {
+         case Command::Queue:
+            program.splice(program.end(), cue->songs);
+            break;
+         case Command::Clear:
+            cue->songs.swap(program); // The old songs go back with the cue.
+            cleared = true;
+            break;
+         case Command::Replace:
+            cue->songs.swap(program);
+            break;
+         case Command::ToggleLoop:
+            looping = !looping;
+            break;
+         case Command::Effect:
+            effects.splice(effects.end(), cue->effects);
+            while (effects.size() > maxEffects.load(std::memory_order_relaxed))
+             {
+               steal();
+             }
+            break;
+         case Command::StopEffects:
+            finishedEffects.splice(finishedEffects.end(), effects);
+            break;
+         case Command::Seek:
+            if (false == program.empty())
+             {
+               seek(program.front(), cue->time, timeDelta);
              }
             break;
+          }
+         retire(cue);
+       }
+      retire(nullptr);
+      return cleared;
+    }
 
-         default:
-            throw std::invalid_argument(std::string("Did not understand command component \'") + command.peek() + "\'.");
+   // Get the front of the queue ready to play the next sample. Returns false if there is nothing to play.
+   bool Venue::cue(double timeDelta)
+    {
+      if (true == takeCues(timeDelta)) // Have we been told to stop?
+       {
+         tell(MusicEvent::Cleared, timeDelta); // Should I tell someone about this?
+       }
+      if (0U == program.size()) // Is there nothing to play?
+       {
+         return false;
+       }
+      if (true == over(program.front())) // Has the most recent song ended?
+       {
+         Performance& current = program.front();
+         if (true == looping) // But, is it looping?
+          {
+            if ((0U == current.loopLength) && (0U != current.captured) && (current.captured == current.sample))
+             {
+               current.loopLength = current.captured; // We have all of it: play it back from now on.
+             }
+            if (0U == current.loopLength)
+             {
+               current.song.loop();
+             }
+            current.sample = 0U;
           }
+         // A song with nothing in it is over again as soon as it is looped: take it off, or it would loop forever.
+         if ((false == looping) || (true == over(current)))
+          {
+            finished.splice(finished.end(), program, program.begin()); // Splicing doesn't free anything: the song is deleted after it is handed back.
+          }
+       }
+      if (0U == program.size()) // Should I tell someone to fill the queue?
+       {
+         tell(MusicEvent::Ended, timeDelta);
        }
+      return (0U != program.size()); // Is there NOW anything to play?
+    }
 
-      return Voice(notes);
+   // Audio thread: tell someone about the event, the way they asked to be told.
+   void Venue::tell(MusicEvent event, double timeDelta)
+    {
+      if (CallbackMode::AudioThread == callbackMode.load(std::memory_order_acquire))
+       {
+         if (nullptr != hollaback)
+          {
+            hollaback();
+            takeCues(timeDelta); // So that music queued by the callback plays without a gap.
+          }
+       }
+      else
+       {
+         size_t posted = eventsPosted.load(std::memory_order_relaxed);
+         if (posted - eventsTaken.load(std::memory_order_acquire) == events.size())
+          {
+            eventsDropped.fetch_add(1U, std::memory_order_relaxed);
+          }
+         else
+          {
+            events[posted % events.size()] = event;
+            eventsPosted.store(posted + 1U, std::memory_order_release);
+          }
+       }
     }
 
-   Maestro::Maestro(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments) : choir()
+   bool Venue::pollMusicEvent(MusicEvent& event)
     {
-      for (auto& voice : music)
+      size_t taken = eventsTaken.load(std::memory_order_relaxed);
+      if (taken == eventsPosted.load(std::memory_order_acquire))
        {
-         choir.emplace_back(buildVoiceFromString(voice, instruments));
-         if (true == choir.back().finished()) // Throw out empty voices.
+         return false;
+       }
+      event = events[taken % events.size()];
+      eventsTaken.store(taken + 1U, std::memory_order_release);
+      return true;
+    }
+
+   size_t Venue::getDroppedMusicEvents() const
+    {
+      return eventsDropped.load(std::memory_order_relaxed);
+    }
+
+   // The dispatcher thread, for CallbackMode::Worker.
+   void Venue::dispatch()
+    {
+      while (true == dispatching.load(std::memory_order_acquire))
+       {
+         MusicEvent event;
+         bool any = false;
+         while (true == pollMusicEvent(event))
           {
-            choir.pop_back();
+            any = true;
+            if (nullptr != hollaback)
+             {
+               hollaback();
+             }
+          }
+         if (false == any)
+          {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
           }
        }
     }
 
-   Maestro::Maestro(const std::vector<Voice>& choir) : choir(choir) { }
+   void Venue::setCallbackMode(CallbackMode mode)
+    {
+      dispatching.store(false, std::memory_order_release);
+      if (true == dispatcher.joinable())
+       {
+         dispatcher.join();
+       }
+      // After the dispatcher has stopped, so that in Polled mode the program is the only one taking events.
+      callbackMode.store(mode, std::memory_order_release);
+      if (CallbackMode::Worker == mode)
+       {
+         dispatching.store(true, std::memory_order_release);
+         dispatcher = std::thread(&Venue::dispatch, this);
+       }
+    }
 
-   double Maestro::play(double time)
+   static inline void fromDouble(double* out, const double* in, size_t count)
     {
-      double sample = 0.0;
-      if (0U != choir.size())
+      std::copy(in, in + count, out);
+    }
+
+   static inline void fromDouble(float* out, const double* in, size_t count)
+    {
+      std::transform(in, in + count, out, [](double sample) { return static_cast<float>(sample); });
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   static inline void fromDouble(short* out, const double* in, size_t count)
+    {
+      std::transform(in, in + count, out, [](double sample)
+       { return static_cast<short>(std::clamp(std::lround(sample * Q15One), -static_cast<long>(Q15One), static_cast<long>(Q15One))); });
+    }
+#endif
+
+   // Copy out of the render-ahead ring, whichever type it is kept in.
+   template <typename Sample> static inline void fromRing(Sample* out, const double* in, size_t count)
+    {
+      fromDouble(out, in, count);
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   template <typename Sample> static inline void fromRing(Sample* out, const short* in, size_t count)
+    {
+      std::transform(in, in + count, out, [](short sample) { return static_cast<Sample>(sample) / Q15One; });
+    }
+
+   static inline void fromRing(short* out, const short* in, size_t count)
+    {
+      std::copy(in, in + count, out);
+    }
+#endif
+
+   // Are these the same sample rate? Not ==: sfGetSample's timeDelta is a float, so it is never quite the double it was set with.
+   static bool sameRate(double timeDelta, double step)
+    {
+      return (timeDelta > 0.0) && (step > 0.0) && (std::lround(1.0 / timeDelta) == std::lround(1.0 / step));
+    }
+
+   // Audio thread: move the performance to the sample nearest time.
+   void Venue::seek(Performance& performance, double time, double timeDelta)
+    {
+      performance.sample = static_cast<size_t>(std::lround(std::max(time, 0.0) / timeDelta));
+      if (0U != performance.loopLength) // It's all recorded.
        {
-         for (auto& voice : choir)
-         {
-            sample += voice.play(time);
-         }
-         sample /= choir.size();
+         performance.sample = std::min(performance.sample, performance.loopLength);
+         return;
        }
-      return sample;
+      if (performance.captured != performance.sample) // Missing a piece, the recording can't be used.
+       {
+         performance.captured = std::numeric_limits<size_t>::max();
+       }
+      if ((0U != performance.preRolled) && (false == sameRate(timeDelta, performance.preRollStep))) // Rendered at the wrong rate: don't use it.
+       {
+         performance.preRolled = 0U;
+       }
+      // The song picks up where the pre-roll leaves off.
+      performance.song.seek(std::max(performance.sample, performance.preRolled), timeDelta);
     }
 
-   bool Maestro::finished() const
+   bool Venue::over(const Performance& performance)
     {
-      bool result = true;
-      for (auto& voice : choir)
+      if (0U != performance.loopLength)
        {
-         result &= voice.finished();
+         return performance.sample >= performance.loopLength;
+       }
+      return (performance.sample >= performance.preRolled) && (true == performance.song.finished());
+    }
+
+   // The loop cache is kept in float, whatever the output is.
+   template <typename Sample> static void toLoop(float* out, const Sample* in, size_t count)
+    {
+      std::transform(in, in + count, out, [](Sample sample) { return static_cast<float>(sample); });
+    }
+
+   template <typename Sample> static void fromLoop(Sample* out, const float* in, size_t count)
+    {
+      std::transform(in, in + count, out, [](float sample) { return static_cast<Sample>(sample); });
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   static void toLoop(float* out, const short* in, size_t count)
+    {
+      std::transform(in, in + count, out, [](short sample) { return static_cast<float>(sample) / Q15One; });
+    }
+
+   static void fromLoop(short* out, const float* in, size_t count)
+    {
+      std::transform(in, in + count, out, [](float sample) { return static_cast<short>(std::lround(sample * Q15One)); });
+    }
+#endif
+
+   // Audio thread: Maestro::render, without ever fixing the song here.
+   template <typename Sample> static size_t renderSong(Maestro& song, Sample* out, size_t count, size_t firstSample, double timeDelta)
+    {
+      return song.render<Sample>(out, count, firstSample, timeDelta);
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   // The song was fixed when it was queued. Fixing it here would allocate, so if it was fixed at some other rate
+   // (or not at all, because the Venue didn't know its rate yet), play it in floating point instead.
+   static size_t renderSong(Maestro& song, short* out, size_t count, size_t firstSample, double timeDelta)
+    {
+      if (true == song.fixedAt(static_cast<uint32_t>(std::lround(1.0 / timeDelta))))
+       {
+         return song.render<short>(out, count, firstSample, timeDelta);
+       }
+      double block [renderBlockSize];
+      size_t result = 0U;
+      while ((result < count) && (false == song.finished()))
+       {
+         size_t played = song.render<double>(block, std::min(renderBlockSize, count - result), firstSample + result, timeDelta);
+         fromDouble(out + result, block, played);
+         result += played;
        }
       return result;
     }
+#endif
 
-   void Maestro::loop()
+   // One sample, the way getSample has always played it.
+   template <typename Sample> static size_t playOne(Maestro& song, Sample* out, size_t sample, double timeDelta)
     {
-      for (auto& voice : choir)
+      // Time is counted in samples from the start of the song, so that it doesn't drift with rounding.
+      *out = song.play<Sample>(sample * timeDelta);
+      return 1U;
+    }
+
+#ifdef TD_SOUND_FIXED_POINT
+   static size_t playOne(Maestro& song, short* out, size_t sample, double timeDelta)
+    {
+      return renderSong(song, out, 1U, sample, timeDelta);
+    }
+#endif
+
+   // Audio thread: play up to count samples of the song, starting with whatever was pre-rolled. Returns the number played.
+   template <typename Sample> size_t Venue::playSong(Performance& performance, Sample* out, size_t count, double timeDelta)
+    {
+      if (0U != performance.loopLength) // Is this a pass after the first, that we have recorded?
        {
-         voice.loop();
+         size_t played = std::min(count, performance.loopLength - performance.sample);
+         fromLoop(out, performance.loop.data() + performance.sample, played);
+         performance.sample += played;
+         return played;
+       }
+      size_t first = performance.sample;
+      if ((0U == performance.sample) && (0U != performance.preRolled) && (false == sameRate(timeDelta, performance.preRollStep)))
+       {
+         performance.song.loop(); // It was rendered at the wrong rate: start over without it.
+         performance.preRolled = 0U;
+       }
+      size_t played = 0U;
+      if (performance.sample < performance.preRolled)
+       {
+         played = std::min(count, performance.preRolled - performance.sample);
+         fromDouble(out, &performance.preRoll[performance.sample], played);
+         performance.sample += played;
+       }
+      if ((played < count) && (false == performance.song.finished()))
+       {
+         size_t rendered = (1U == count - played) ?
+            playOne(performance.song, out + played, performance.sample, timeDelta) :
+            renderSong(performance.song, out + played, count - played, performance.sample, timeDelta);
+         performance.sample += rendered;
+         played += rendered;
        }
+      if ((false == performance.loop.empty()) && (performance.captured == first)) // Record the first pass, unless we have missed some.
+       {
+         if ((first + played <= performance.loop.size()) && (true == sameRate(timeDelta, performance.loopStep)))
+          {
+            toLoop(performance.loop.data() + first, out, played);
+            performance.captured += played;
+          }
+         else
+          {
+            performance.captured = std::numeric_limits<size_t>::max();
+          }
+       }
+      return played;
     }
 
-   Venue::Venue() : program(), stopPlaying(false), looping(false), internalTime(-1.0), hollaback(nullptr) { }
+   // The sample of the current song that the crossfade to the next starts on, or the largest size_t if there won't be one.
+   size_t Venue::fadeStart(const Performance& current, size_t fade, double timeDelta) const
+    {
+      if ((0U == fade) || (true == looping) || (program.size() < 2U))
+       {
+         return std::numeric_limits<size_t>::max();
+       }
+      size_t end = static_cast<size_t>(current.song.length() / timeDelta) + 1U;
+      return (end > fade) ? (end - fade) : 0U;
+    }
 
-   Venue& Venue::getInstance()
+   template <typename Sample> static Sample blend(Sample from, Sample to, double fromGain, double toGain)
     {
-      static Venue instance;
-      return instance;
+      return static_cast<Sample>(from * fromGain + to * toGain);
     }
 
-   void Venue::queueMusic(const std::vector<std::string>& music, const std::map<char, Instrument>& instruments)
+#ifdef TD_SOUND_FIXED_POINT
+   static short blend(short from, short to, double fromGain, double toGain)
     {
-      program.emplace_back(music, instruments);
+      return static_cast<short>(std::clamp(std::lround(from * fromGain + to * toGain), -static_cast<long>(Q15One), static_cast<long>(Q15One)));
     }
+#endif
 
-   void Venue::queueMusic(const Maestro& song)
+   // Audio thread: play up to count samples (no more than a block) of the crossfade from the current song to the next.
+   template <typename Sample> size_t Venue::crossfade(Sample* out, size_t count, size_t fadeFrom, size_t fade, double timeDelta)
     {
-      program.push_back(song);
+      Performance& outgoing = program.front();
+      Performance& incoming = *std::next(program.begin());
+      size_t first = outgoing.sample;
+      size_t played = playSong(outgoing, out, count, timeDelta);
+
+      Sample block [renderBlockSize];
+      std::fill(block, block + played, Sample(0));
+      playSong(incoming, block, played, timeDelta);
+      for (size_t i = 0U; i < played; ++i)
+       {
+         double angle = std::min(static_cast<double>(first + i - fadeFrom) / fade, 1.0) * M_PI_2;
+         out[i] = blend(out[i], block[i], std::cos(angle), std::sin(angle));
+       }
+      return played;
     }
 
-   void Venue::clearQueue()
+   // Audio thread: stop one effect to make room for another.
+   void Venue::steal()
     {
-      stopPlaying = true;
+      std::list<Effect>::iterator victim = effects.begin();
+      if (StealPolicy::Quietest == stealPolicy.load(std::memory_order_relaxed))
+       {
+         for (auto effect = effects.begin(); effect != effects.end(); ++effect)
+          {
+            if ((0.0 <= effect->level) && ((0.0 > victim->level) || (effect->level < victim->level)))
+             {
+               victim = effect;
+             }
+          }
+       }
+      finishedEffects.splice(finishedEffects.end(), effects, victim);
     }
 
-   void Venue::toggleLoop()
+   template <typename Sample> static double peakLevel(const Sample* in, size_t count)
     {
-      looping = !looping;
+      double result = 0.0;
+      for (size_t i = 0U; i < count; ++i)
+       {
+         result = std::max(result, std::fabs(static_cast<double>(in[i])));
+       }
+      return result;
     }
 
-   void Venue::addMusicCallback(std::function<void(void)> callOnMusicDone)
+   // Mix in onto out at the given volume. This scales in.
+   template <typename Sample> static void mixEffect(Sample* out, Sample* in, size_t count, double volume)
     {
-      hollaback = callOnMusicDone;
+      scaleSamples(in, static_cast<Sample>(volume), count);
+      addSamples(out, in, count);
     }
 
-   double Venue::getSample(int unused, double /*globalTime*/, double timeDelta)
+#ifdef TD_SOUND_FIXED_POINT
+   static void mixEffect(short* out, short* in, size_t count, double volume)
     {
-      if (0 != unused) // Is this the wrong channel?
+      // In 64 bits, as a volume of 2 or more would overflow an int. Louder than 65536, and any sample but zero saturates anyway.
+      int64_t scale = std::lround(std::clamp(volume, -65536.0, 65536.0) * 32768.0);
+      for (size_t i = 0U; i < count; ++i)
        {
-         return 0.0;
+         out[i] = static_cast<short>(std::clamp<int64_t>(out[i] + ((in[i] * scale) >> 15), -Q15One, Q15One));
        }
-      if (true == stopPlaying) // Have we been told to stop?
+    }
+#endif
+
+   static const double effectLevelHalfLife = 0.05; // In seconds.
+
+   // Audio thread: mix every effect onto out, and retire the ones that finish.
+   template <typename Sample> void Venue::playEffects(Sample* out, size_t count, double timeDelta)
+    {
+      Sample block [renderBlockSize];
+      std::list<Effect>::iterator effect = effects.begin();
+      while (effect != effects.end())
        {
-         program.clear();
-         stopPlaying = false;
-         internalTime = -1.0;
-         if (nullptr != hollaback) // Should I tell someone about this?
+         size_t done = 0U;
+         while ((done < count) && (false == effect->song.finished()))
           {
-            hollaback();
+            size_t length = std::min(renderBlockSize, count - done);
+            size_t played = renderSong(effect->song, block, length, effect->sample, timeDelta);
+            double decay = std::exp2(-(played * timeDelta) / effectLevelHalfLife);
+            effect->level = std::max(peakLevel(block, played) * effect->volume, effect->level * decay);
+            mixEffect(out + done, block, played, effect->volume);
+            effect->sample += played;
+            done += played;
+          }
+         std::list<Effect>::iterator next = std::next(effect);
+         if (true == effect->song.finished())
+          {
+            finishedEffects.splice(finishedEffects.end(), effects, effect);
           }
+         effect = next;
        }
-      if (0U == program.size()) // Is there nothing to play?
+    }
+
+   template <typename Sample> Sample Venue::getSample(int unused, double /*globalTime*/, double timeDelta)
+    {
+      if (0 != unused) // Is this the wrong channel?
        {
-         return 0.0;
+         return 0;
        }
-      if (true == program.front().finished()) // Has the most recent song ended?
+      if (nullptr != ring) // Has it already been rendered?
        {
-         if (true == looping) // But, is it looping?
+         Sample result;
+         ring->take(&result, 1U);
+         return result;
+       }
+      Sample result;
+      perform(&result, 1U, timeDelta);
+      return result;
+    }
+
+   template <typename Sample> void Venue::render(Sample* out, size_t count, double timeDelta)
+    {
+      if (nullptr != ring)
+       {
+         ring->take(out, count);
+       }
+      else
+       {
+         perform(out, count, timeDelta);
+       }
+    }
+
+   template <typename Sample> void Venue::perform(Sample* out, size_t count, double timeDelta)
+    {
+      playedStep.store(timeDelta, std::memory_order_relaxed); // So that songs queued from now on are fixed at this rate.
+      size_t done = 0U;
+      while (done < count)
+       {
+         if (false == cue(timeDelta))
           {
-            program.front().loop();
+            out[done] = 0;
+            ++done;
           }
          else
           {
-            program.pop_front();
+            Performance& current = program.front();
+            size_t fade = crossfadeSamples.load(std::memory_order_relaxed);
+            size_t fadeFrom = fadeStart(current, fade, timeDelta);
+            size_t played;
+            if (current.sample < fadeFrom) // Play up to the crossfade, if there is one.
+             {
+               played = playSong(current, out + done, std::min(count - done, fadeFrom - current.sample), timeDelta);
+             }
+            else
+             {
+               played = crossfade(out + done, std::min(count - done, renderBlockSize), fadeFrom, fade, timeDelta);
+             }
+            if (0U == played) // Whatever went wrong, don't wait on it forever: play silence, and look again next sample.
+             {
+               out[done] = 0;
+               played = 1U;
+             }
+            done += played;
           }
-         internalTime = -1.0;
        }
-      if ((0U == program.size()) && (nullptr != hollaback)) // Should I tell someone to fill the queue?
+      if (false == effects.empty())
+       {
+         playEffects(out, count, timeDelta);
+       }
+    }
+
+   Venue::Ring::Ring(size_t capacity) : samples(capacity), written(0U), read(0U), lowestFill(capacity), underruns(0U) { }
+
+   // Only the audio thread takes from the ring. If the render thread hasn't kept up, the rest is silence.
+   template <typename Sample> void Venue::Ring::take(Sample* out, size_t count)
+    {
+      const size_t capacity = samples.size();
+      size_t from = read.load(std::memory_order_relaxed);
+      size_t fill = written.load(std::memory_order_acquire) - from;
+      size_t taking = std::min(fill, count);
+      size_t at = from % capacity;
+      size_t first = std::min(taking, capacity - at);
+      fromRing(out, &samples[at], first);
+      fromRing(out + first, &samples[0], taking - first);
+      read.store(from + taking, std::memory_order_release);
+
+      if (taking < count)
+       {
+         std::fill(out + taking, out + count, static_cast<Sample>(0));
+         underruns.fetch_add(1U, std::memory_order_relaxed);
+       }
+      if (fill - taking < lowestFill.load(std::memory_order_relaxed))
+       {
+         lowestFill.store(fill - taking, std::memory_order_relaxed);
+       }
+    }
+
+   void Venue::renderAhead(double timeDelta)
+    {
+      const size_t capacity = ring->samples.size();
+      // Don't bother waking up for less than a block, unless the ring is tiny.
+      const size_t least = std::min(renderBlockSize, capacity);
+      while (true == renderingAhead.load(std::memory_order_acquire))
        {
-         hollaback();
+         size_t to = ring->written.load(std::memory_order_relaxed);
+         size_t space = capacity - (to - ring->read.load(std::memory_order_acquire));
+         if (space < least)
+          {
+            std::this_thread::sleep_for(std::chrono::duration<double>(least * timeDelta / 2.0));
+          }
+         else
+          {
+            size_t at = to % capacity;
+            size_t count = std::min(space, capacity - at);
+            perform(&ring->samples[at], count, timeDelta);
+            ring->written.store(to + count, std::memory_order_release);
+          }
        }
-      if (0U == program.size()) // Is there NOW nothing to play?
+    }
+
+   void Venue::startRenderAhead(size_t latency, double timeDelta)
+    {
+      if (0U == latency)
        {
-         return 0.0;
+         throw std::invalid_argument("Render-ahead latency must be at least one sample.");
        }
-      if (-1.0 == internalTime) // Have we just started playing this song?
+      stopRenderAhead();
+      ring = std::make_unique<Ring>(latency);
+      renderingAhead.store(true, std::memory_order_release);
+      renderer = std::thread(&Venue::renderAhead, this, timeDelta);
+    }
+
+   void Venue::stopRenderAhead()
+    {
+      renderingAhead.store(false, std::memory_order_release);
+      if (true == renderer.joinable())
        {
-         internalTime = 0.0;
+         renderer.join();
        }
-      else
+      // Whatever was rendered but not played is lost: the program has already moved on past it.
+      ring.reset();
+    }
+
+   Venue::RenderAheadStats Venue::getRenderAheadStats(bool reset)
+    {
+      RenderAheadStats result { 0U, 0U, 0U, 0U };
+      if (nullptr != ring)
        {
-         internalTime += timeDelta;
+         result.capacity = ring->samples.size();
+         result.fill = ring->written.load(std::memory_order_acquire) - ring->read.load(std::memory_order_acquire);
+         if (true == reset)
+          {
+            result.lowestFill = ring->lowestFill.exchange(result.fill, std::memory_order_relaxed);
+            result.underruns = ring->underruns.exchange(0U, std::memory_order_relaxed);
+          }
+         else
+          {
+            result.lowestFill = ring->lowestFill.load(std::memory_order_relaxed);
+            result.underruns = ring->underruns.load(std::memory_order_relaxed);
+          }
        }
-      return program.front().play(internalTime);
+      return result;
     }
 
    double Venue::sdGetSample(int unused, double globalTime, double timeDelta)
     {
-      return getInstance().getSample(unused, globalTime, timeDelta);
+      return getInstance().getSample<double>(unused, globalTime, timeDelta);
     }
 
    float Venue::sfGetSample(int unused, float globalTime, float timeDelta)
     {
-      return getInstance().getSample(unused, globalTime, timeDelta);
+      return getInstance().getSample<float>(unused, globalTime, timeDelta);
     }
 
+   template float Note::play<float>(double) const;
+   template double Note::play<double>(double) const;
+   template float Voice::play<float>(double);
+   template double Voice::play<double>(double);
+   template size_t Voice::render<float>(float*, size_t, size_t, double);
+   template size_t Voice::render<double>(double*, size_t, size_t, double);
+   template float Voice::playActive<float>(double) const;
+   template double Voice::playActive<double>(double) const;
+   template float Maestro::play<float>(double);
+   template double Maestro::play<double>(double);
+   template size_t Maestro::render<float>(float*, size_t, size_t, double);
+   template size_t Maestro::render<double>(double*, size_t, size_t, double);
+   template size_t Voice::renderRange<float>(float*, size_t, size_t, double) const;
+   template size_t Voice::renderRange<double>(double*, size_t, size_t, double) const;
+   template size_t Maestro::renderRange<float>(float*, size_t, size_t, double) const;
+   template size_t Maestro::renderRange<double>(double*, size_t, size_t, double) const;
+   template size_t Maestro::renderStem<float>(size_t, float*, size_t, size_t, double) const;
+   template size_t Maestro::renderStem<double>(size_t, double*, size_t, size_t, double) const;
+   template void Maestro::mixStems<float>(float*, const float* const*, size_t, size_t);
+   template void Maestro::mixStems<double>(double*, const double* const*, size_t, size_t);
+#ifdef TD_SOUND_FIXED_POINT
+   template size_t Maestro::renderRange<short>(short*, size_t, size_t, double) const;
+#endif
+   template float Venue::getSample<float>(int, double, double);
+   template double Venue::getSample<double>(int, double, double);
+   template void Venue::render<float>(float*, size_t, double);
+   template void Venue::render<double>(double*, size_t, double);
+#ifdef TD_SOUND_FIXED_POINT
+   template void Venue::render<short>(short*, size_t, double);
+#endif
+
 #endif /* TD_SOUND_IMPLEMENTATION */
 
  } // namespace TD_SOUND